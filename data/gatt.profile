@@ -44,15 +44,26 @@
 0xC5, 0x45, 0x36, 0x6F, 0xF2, 0xC2, 0x45, 0x33, 
 // Characteristic FOTA Data: {3345c2f3-6f36-45c5-8541-92f56728d5f3}
 0x1B, 0x00, 0x02, 0x00, 0x0C, 0x00, 0x03, 0x28,
-0x04, 0x0D, 0x00, 0xF3, 0xD5, 0x28, 0x67, 0xF5, 
+0x06, 0x0D, 0x00, 0xF3, 0xD5, 0x28, 0x67, 0xF5, 
 0x92, 0x41, 0x85, 0xC5, 0x45, 0x36, 0x6F, 0xF3, 
 0xC2, 0x45, 0x33, 
-0x16, 0x00, 0x04, 0x03, 0x0D, 0x00,
+0x16, 0x00, 0x06, 0x03, 0x0D, 0x00,
 0xF3, 0xD5, 0x28, 0x67, 0xF5, 0x92, 0x41, 0x85, 
 0xC5, 0x45, 0x36, 0x6F, 0xF3, 0xC2, 0x45, 0x33, 
+// Characteristic FOTA Status: {3345c2f4-6f36-45c5-8541-92f56728d5f3}
+0x1B, 0x00, 0x02, 0x00, 0x0E, 0x00, 0x03, 0x28,
+0x10, 0x0F, 0x00, 0xF3, 0xD5, 0x28, 0x67, 0xF5, 
+0x92, 0x41, 0x85, 0xC5, 0x45, 0x36, 0x6F, 0xF4, 
+0xC2, 0x45, 0x33, 
+0x16, 0x00, 0x10, 0x02, 0x0F, 0x00,
+0xF3, 0xD5, 0x28, 0x67, 0xF5, 0x92, 0x41, 0x85, 
+0xC5, 0x45, 0x36, 0x6F, 0xF4, 0xC2, 0x45, 0x33, 
+// Descriptor Client Characteristic Configuration: 2902
+0x0A, 0x00, 0x0A, 0x01, 0x10, 0x00, 0x02, 0x29,
+0x00, 0x00, 
 
 0x00,0x00
-// total size = 305
+// total size = 364
 
 // HANDLE_GENERIC_INPUT=3
 // HANDLE_GENERIC_OUTPUT=5
@@ -60,6 +71,8 @@
 // HANDLE_FOTA_VERSION=9
 // HANDLE_FOTA_CONTROL=11
 // HANDLE_FOTA_DATA=13
+// HANDLE_FOTA_STATUS=15
+// HANDLE_FOTA_STATUS_CLIENT_CHAR_CONFIG=16
 
 // HANDLE_GENERIC_INPUT_OFFSET=73
 // HANDLE_GENERIC_OUTPUT_OFFSET=122
@@ -67,3 +80,5 @@
 // HANDLE_FOTA_VERSION_OFFSET=205
 // HANDLE_FOTA_CONTROL_OFFSET=254
 // HANDLE_FOTA_DATA_OFFSET=303
+// HANDLE_FOTA_STATUS_OFFSET=352
+// HANDLE_FOTA_STATUS_CLIENT_CHAR_CONFIG_OFFSET=360
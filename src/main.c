@@ -9,6 +9,8 @@
 #include "eflash.h"
 #include "trace.h"
 #include "uart_at.h"
+#include "rom_tools.h"
+#include "ota_service.h"
 
 static uint32_t uart0_isr(void *data);
 
@@ -42,8 +44,11 @@ static uint32_t cb_heap_out_of_mem(uint32_t tag, void *_)
 
 #define PRINT_PORT    APB_UART0
 
+static int defer_tx(char c);
+
 uint32_t cb_putc(char *c, void *dummy)
 {
+    if (defer_tx(*c)) return 0;
     while (apUART_Check_TXFIFO_FULL(PRINT_PORT) == 1);
     UART_SendData(PRINT_PORT, (uint8_t)*c);
     return 0;
@@ -55,15 +60,263 @@ int fputc(int ch, FILE *f)
     return ch;
 }
 
+static uint32_t current_baud = 115200;
+
 void update_baud(uint32_t baud)
 {
+    current_baud = baud;
     apUART_BaudRateSet(CMD_PORT, SYSCTRL_GetClk(SYSCTRL_ITEM_APB_UART0), baud);
 }
 
+uint32_t uart_get_baud(void)
+{
+    return current_baud;
+}
+
+// UART samples each bit 16 times
+int uart_baud_supported(uint32_t baud)
+{
+    return (baud >= 1200) && (SYSCTRL_GetClk(SYSCTRL_ITEM_APB_UART0) / 16 >= baud);
+}
+
+// wait until everything (including the byte in the shift register) is sent
+static void uart_drain(void)
+{
+    uint64_t t;
+    while (!apUART_Check_TXFIFO_EMPTY(CMD_PORT)) ;
+    t = platform_get_us_time();
+    while (platform_get_us_time() - t < 10000000 / current_baud + 1) ;
+}
+
+// change baud rate after the response at the old rate is sent out
+void uart_switch_baud(uint32_t baud)
+{
+    uart_drain();
+    update_baud(baud);
+}
+
+// RTS/CTS hardware flow control of CMD_PORT
+#ifndef UART_RTS_PIN
+#define UART_RTS_PIN        GIO_GPIO_3
+#endif
+
+#ifndef UART_CTS_PIN
+#define UART_CTS_PIN        GIO_GPIO_4
+#endif
+
+// RXD of CMD_PORT, as configured in `cube_setup_peripherals`
+#ifndef UART_RXD_PIN
+#define UART_RXD_PIN        GIO_GPIO_2
+#endif
+
+#define FLOW_CONTROL_MASK   ((1 << bsUART_CTS_ENA) | (1 << bsUART_RTS_ENA))
+
+static uint8_t flow_control = 0;
+
+static void enable_flow_control(void)
+{
+    PINCTRL_SetPadMux(UART_RTS_PIN, IO_SOURCE_UART0_RTS);
+#if (INGCHIPS_FAMILY == INGCHIPS_FAMILY_916)
+    PINCTRL_SelUartIn(UART_PORT_0, UART_RXD_PIN, UART_CTS_PIN);
+#else
+    PINCTRL_SelUartCtsIn(UART_PORT_0, UART_CTS_PIN);
+#endif
+    CMD_PORT->Control |= FLOW_CONTROL_MASK;
+}
+
+// undo `enable_flow_control`; pins are left as `cube_setup_peripherals`
+// configures them, as long as flow control has never been enabled
+static void disable_flow_control(void)
+{
+    CMD_PORT->Control &= ~FLOW_CONTROL_MASK;
+    PINCTRL_SetPadMux(UART_RTS_PIN, IO_SOURCE_GPIO);
+#if (INGCHIPS_FAMILY == INGCHIPS_FAMILY_916)
+    PINCTRL_SelUartIn(UART_PORT_0, UART_RXD_PIN, IO_NOT_A_PIN);
+#endif
+}
+
+void uart_set_flow_control(uint8_t enable)
+{
+    if (enable == flow_control) return;
+    uart_drain();
+    if (enable)
+        enable_flow_control();
+    else
+        disable_flow_control();
+    flow_control = enable;
+}
+
+// UART wake protocol, used when power saving is enabled.
+//
+// UART_WAKE_PIN (input): host keeps it high while it talks to us. A rising
+// edge wakes us from deep sleep, and sleep is not allowed while it is high.
+//
+// HOST_READY_PIN (output): high when UART is powered and ready, or when we
+// have data for host (host may use it as an IRQ). It goes low right before
+// deep sleep.
+#if (INGCHIPS_FAMILY == INGCHIPS_FAMILY_916)
+// GPIO 6 is WAKEUP_PIN of shutdown, see config_wakeup_and_shutdown
+#ifndef UART_WAKE_PIN
+#define UART_WAKE_PIN       GIO_GPIO_7
+#endif
+#ifndef HOST_READY_PIN
+#define HOST_READY_PIN      GIO_GPIO_5
+#endif
+#endif
+
+// stay awake for this long after last byte received or sent
+#ifndef UART_IDLE_HOLD_US
+#define UART_IDLE_HOLD_US   10000
+#endif
+
+// when HOST_READY_PIN is raised for outbound data, wait this long before
+// the first byte, so that host has time to wake up
+#ifndef HOST_READY_LEAD_US
+#define HOST_READY_LEAD_US  500
+#endif
+
+// output held back during HOST_READY_LEAD_US; if more is sent, the sender
+// waits for the rest of the lead time
+#ifndef HOST_READY_DEFER_SIZE
+#define HOST_READY_DEFER_SIZE   256
+#endif
+
+// platform timer runs at 1600Hz
+#define HOST_READY_LEAD_TICKS   (HOST_READY_LEAD_US * 16 / 10000 + 1)
+
+static uint8_t host_ready = 1;
+static volatile uint64_t uart_last_active = 0;
+static uint64_t host_ready_time = 0;    // when HOST_READY_PIN was raised for outbound data
+static volatile uint8_t tx_deferred = 0;
+static uint16_t deferred_size = 0;
+static char deferred_tx[HOST_READY_DEFER_SIZE];
+static uint64_t wakeup_time = 0;        // 0: not woken up by host
+static uint32_t wake_to_rx_last = 0;
+static uint32_t wake_to_rx_max = 0;
+
+static void set_host_ready(uint8_t ready)
+{
+    host_ready = ready;
+#ifdef HOST_READY_PIN
+    GIO_WriteValue(HOST_READY_PIN, ready);
+#endif
+}
+
+static int is_host_waking(void)
+{
+#ifdef UART_WAKE_PIN
+    return GIO_ReadValue(UART_WAKE_PIN);
+#else
+    return 0;
+#endif
+}
+
+static void setup_wake_pins(void)
+{
+#if defined(UART_WAKE_PIN) && defined(HOST_READY_PIN)
+    SYSCTRL_ClearClkGate(SYSCTRL_ITEM_APB_GPIO0);
+    SYSCTRL_ClearClkGate(SYSCTRL_ITEM_APB_GPIO1);
+    PINCTRL_SetPadMux(UART_WAKE_PIN, IO_SOURCE_GPIO);
+    PINCTRL_SetPadMux(HOST_READY_PIN, IO_SOURCE_GPIO);
+    GIO_SetDirection(UART_WAKE_PIN, GIO_DIR_INPUT);
+    PINCTRL_Pull(UART_WAKE_PIN, PINCTRL_PULL_DOWN);
+    GIO_EnableDeepSleepWakeupSource(UART_WAKE_PIN, 1, 1, PINCTRL_PULL_DOWN);
+    GIO_SetDirection(HOST_READY_PIN, GIO_DIR_OUTPUT);
+    GIO_WriteValue(HOST_READY_PIN, host_ready);
+#endif
+}
+
+// uart_last_active is also written by the UART ISR, and a 64-bit access
+// is not atomic
+static uint64_t get_uart_last_active(void)
+{
+    uint64_t t;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    t = uart_last_active;
+    __set_PRIMASK(primask);
+    return t;
+}
+
+static void set_uart_last_active(uint64_t t)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uart_last_active = t;
+    __set_PRIMASK(primask);
+}
+
+// called with output locked (see tx_data)
+static void flush_deferred_tx(void)
+{
+    uint16_t i;
+    tx_deferred = 0;
+    for (i = 0; i < deferred_size; i++)
+        cb_putc(deferred_tx + i, NULL);
+    deferred_size = 0;
+}
+
+// non-zero if `c` is held back until host is ready
+static int defer_tx(char c)
+{
+    if (0 == tx_deferred) return 0;
+    if (deferred_size < sizeof(deferred_tx))
+    {
+        deferred_tx[deferred_size++] = c;
+        return 1;
+    }
+    while (platform_get_us_time() - host_ready_time < HOST_READY_LEAD_US) ;
+    flush_deferred_tx();
+    return 0;
+}
+
+static void host_ready_lead_timeout(void)
+{
+    // the timer may fire up to a tick early
+    if (platform_get_us_time() - host_ready_time < HOST_READY_LEAD_US)
+    {
+        platform_set_timer(host_ready_lead_timeout, 1);
+        return;
+    }
+    taskENTER_CRITICAL();
+    if (tx_deferred) flush_deferred_tx();
+    taskEXIT_CRITICAL();
+}
+
+// called before sending anything to host. If HOST_READY_PIN is low, it is
+// raised, and output is held back for HOST_READY_LEAD_US instead of waiting
+// here (this is called from stack callbacks).
+void uart_wake_tx_begin(void)
+{
+    uint64_t now = platform_get_us_time();
+    int start;
+
+    set_uart_last_active(now);
+    taskENTER_CRITICAL();
+    start = !host_ready;
+    if (start)
+    {
+        set_host_ready(1);
+        host_ready_time = now;
+        tx_deferred = 1;
+    }
+    taskEXIT_CRITICAL();
+    if (start)
+        platform_set_timer(host_ready_lead_timeout, HOST_READY_LEAD_TICKS);
+}
+
+void uart_wake_get_latency(uint32_t *last, uint32_t *max)
+{
+    *last = wake_to_rx_last;
+    *max = wake_to_rx_max;
+}
+
 void setup_peripherals(void)
 {
     GIO_EnableRetentionGroupA(0);
     cube_setup_peripherals();
+    if (flow_control) enable_flow_control();
+    setup_wake_pins();
     platform_enable_irq(PLATFORM_CB_IRQ_UART0, 1);
 }
 
@@ -89,6 +342,16 @@ uint32_t on_deep_sleep_wakeup(void *dummy, void *user_data)
     (void)(dummy);
     (void)(user_data);
     setup_peripherals();
+    // UART is reset to the default baud rate by `cube_setup_peripherals`,
+    // flow control is restored by `setup_peripherals`
+    update_baud(current_baud);
+    if (is_host_waking())
+    {
+        wakeup_time = platform_get_us_time();
+        set_host_ready(1);
+    }
+    else
+        wakeup_time = 0;
     return 0;
 }
 
@@ -96,6 +359,18 @@ uint32_t query_deep_sleep_allowed(void *dummy, void *user_data)
 {
     (void)(dummy);
     (void)(user_data);
+    if (is_host_waking())
+    {
+        set_host_ready(1);
+        return 0;
+    }
+    if (   at_rx_pending()
+        || tx_deferred
+        || !apUART_Check_TXFIFO_EMPTY(CMD_PORT)
+        || (platform_get_us_time() - get_uart_last_active() < UART_IDLE_HOLD_US))
+        return 0;
+
+    set_host_ready(0);
     return 1;
 }
 
@@ -108,20 +383,231 @@ static void watchdog_task(void *pdata)
     }
 }
 
-#if (INGCHIPS_FAMILY == INGCHIPS_FAMILY_916)
-    #define DB_FLASH_ADDRESS  0x2040000
-#elif (INGCHIPS_FAMILY == INGCHIPS_FAMILY_918)
-    #define DB_FLASH_ADDRESS  0x40000
-#endif
-int db_write_to_flash(const void *db, const int size)
+// kv database is kept as an append-only log in two flash sectors, starting
+// from DB_FLASH_ADDRESS. A commit only appends the bytes that changed since
+// the last one; when the active sector is full, the whole database is
+// written into the other sector (compaction), which then becomes active.
+//
+// sector: db_sector_header_t, followed by records
+// record: db_record_t, followed by `len` bytes of data, padded to 4 bytes
+//
+// The records of a commit are followed by a commit record (no data), and
+// only complete commits are replayed, so a commit is applied as a whole or
+// not at all. The header of a record (or sector) is written after its data,
+// so an interrupted write is either ignored or detected by `check`.
+
+#define DB_SECTOR_SIZE      (DB_FLASH_SIZE / 2)
+#define DB_LOG_MAGIC        0x474c564b  // "KVLG"
+#define DB_RECORD_END       0xffff
+#define DB_RECORD_COMMIT    0xfffe      // `offset` of the commit record
+// unchanged gaps shorter than a record header are merged into one record
+#define DB_RECORD_MERGE_GAP (sizeof(db_record_t))
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+} db_sector_header_t;
+
+typedef struct
 {
-    program_flash(DB_FLASH_ADDRESS, (const uint8_t *)db, size);
+    uint16_t offset;
+    uint16_t len;
+    uint16_t check;
+    uint16_t reserved;
+} db_record_t;
+
+static uint8_t *db_shadow = NULL;       // database of the last commit
+static uint32_t db_sector = DB_FLASH_ADDRESS;
+static uint32_t db_seq = 0;
+static uint32_t db_log_end = 0;         // where the next record is appended
+static uint32_t db_commit_end = 0;      // end of the last commit record
+static uint8_t  db_need_compact = 1;
+
+#define DB_ALIGN4(n)        (((n) + 3) & ~3)
+
+static uint16_t db_record_check(uint16_t offset, uint16_t len, const uint8_t *data)
+{
+    return crc((uint8_t *)data, len) ^ offset ^ len;
+}
+
+static int db_append_record(uint16_t offset, const uint8_t *data, uint16_t len)
+{
+    db_record_t rec = {.offset = offset, .len = len,
+                       .check = db_record_check(offset, len, data), .reserved = 0xffff};
+    uint32_t addr = db_log_end + sizeof(rec);
+    uint16_t aligned = len & ~3;
+    // room is always kept for the commit record
+    uint32_t end = db_sector + DB_SECTOR_SIZE - (offset == DB_RECORD_COMMIT ? 0 : sizeof(rec));
+
+    if (db_log_end + sizeof(rec) + DB_ALIGN4(len) > end)
+        return -1;
+
+    if (aligned)
+        write_flash(addr, data, aligned);
+    if (len & 3)
+    {
+        uint32_t tail = 0xffffffff;
+        memcpy(&tail, data + aligned, len & 3);
+        write_flash(addr + aligned, (const uint8_t *)&tail, sizeof(tail));
+    }
+    write_flash(db_log_end, (const uint8_t *)&rec, sizeof(rec));
+    db_log_end = addr + DB_ALIGN4(len);
+    return 0;
+}
+
+static int db_compact(const uint8_t *db, const int size)
+{
+    db_sector_header_t header = {.magic = DB_LOG_MAGIC, .seq = db_seq + 1};
+    uint32_t sector = db_sector == DB_FLASH_ADDRESS ? DB_FLASH_ADDRESS + DB_SECTOR_SIZE : DB_FLASH_ADDRESS;
+    uint32_t old_sector = db_sector;
+    uint32_t old_log_end = db_log_end;
+
+    erase_flash_page(sector);
+    db_sector = sector;
+    db_log_end = sector + sizeof(header);
+    if (db_append_record(0, db, size) || db_append_record(DB_RECORD_COMMIT, db, 0))
+    {
+        // the database does not fit: the new sector has no header, and
+        // the old one is kept active
+        db_sector = old_sector;
+        db_log_end = old_log_end;
+        db_need_compact = 1;
+        return -1;
+    }
+    db_commit_end = db_log_end;
+    // the old sector stays valid until the new header is written
+    write_flash(sector, (const uint8_t *)&header, sizeof(header));
+    db_seq = header.seq;
+    db_need_compact = 0;
+    return 0;
+}
+
+static int db_write_log(const void *db, const int size)
+{
+    const uint8_t *p = (const uint8_t *)db;
+    int i = 0;
+
+    if (db_need_compact)
+        goto compact;
+
+    while (i < size)
+    {
+        int start, last, j;
+        if (p[i] == db_shadow[i])
+        {
+            i++;
+            continue;
+        }
+
+        start = last = i;
+        for (j = i + 1; (j < size) && (j - last <= (int)DB_RECORD_MERGE_GAP); j++)
+            if (p[j] != db_shadow[j]) last = j;
+
+        if (db_append_record(start, p + start, last - start + 1))
+            goto compact;
+        i = last + 1;
+    }
+    if (db_log_end != db_commit_end)
+    {
+        db_append_record(DB_RECORD_COMMIT, p, 0);
+        db_commit_end = db_log_end;
+    }
+    memcpy(db_shadow, db, size);
+    return KV_OK;
+
+compact:
+    if (db_compact(p, size))
+        return -1;
+    memcpy(db_shadow, db, size);
     return KV_OK;
 }
 
+// OTA may be programming a page in the background
+int db_write_to_flash(const void *db, const int size)
+{
+    int r;
+    ota_flash_lock();
+    r = db_write_log(db, size);
+    ota_flash_unlock();
+    return r;
+}
+
+static void db_replay(uint32_t sector, uint8_t *db, const int max_size)
+{
+    uint32_t start = sector + sizeof(db_sector_header_t);
+    uint32_t end = sector + DB_SECTOR_SIZE;
+    uint32_t addr = start;
+    uint32_t committed = start;
+
+    // find the end of the last complete commit
+    while (addr + sizeof(db_record_t) <= end)
+    {
+        const db_record_t *rec = (const db_record_t *)addr;
+        const uint8_t *data = (const uint8_t *)(addr + sizeof(db_record_t));
+        if (DB_RECORD_END == rec->offset)
+            break;
+        if (   ((rec->offset != DB_RECORD_COMMIT) && (rec->offset + rec->len > max_size))
+            || (addr + sizeof(db_record_t) + DB_ALIGN4(rec->len) > end)
+            || (rec->check != db_record_check(rec->offset, rec->len, data)))
+            break;
+        addr += sizeof(db_record_t) + DB_ALIGN4(rec->len);
+        if (DB_RECORD_COMMIT == rec->offset)
+            committed = addr;
+    }
+
+    memset(db, 0xff, max_size);
+    for (addr = start; addr < committed; )
+    {
+        const db_record_t *rec = (const db_record_t *)addr;
+        if (rec->offset != DB_RECORD_COMMIT)
+            memcpy(db + rec->offset, (const uint8_t *)(addr + sizeof(db_record_t)), rec->len);
+        addr += sizeof(db_record_t) + DB_ALIGN4(rec->len);
+    }
+
+    // anything after it is an interrupted commit, cleaned up by compaction
+    db_commit_end = committed;
+    for (db_log_end = committed; addr < end; addr += 4)
+    {
+        if (*(const uint32_t *)addr != 0xffffffff)
+        {
+            db_need_compact = 1;
+            break;
+        }
+    }
+}
+
 int db_read_from_flash(void *db, const int max_size)
 {
-    memcpy(db, (void *)DB_FLASH_ADDRESS, max_size);
+    const db_sector_header_t *h0 = (const db_sector_header_t *)DB_FLASH_ADDRESS;
+    const db_sector_header_t *h1 = (const db_sector_header_t *)(DB_FLASH_ADDRESS + DB_SECTOR_SIZE);
+
+    if (NULL == db_shadow)
+    {
+        db_shadow = (uint8_t *)pvPortMalloc(max_size);
+        if (NULL == db_shadow) platform_raise_assertion(__FILE__, __LINE__);
+    }
+
+    db_need_compact = 0;
+    if ((h0->magic == DB_LOG_MAGIC) || (h1->magic == DB_LOG_MAGIC))
+    {
+        if ((h0->magic != DB_LOG_MAGIC) ||
+            ((h1->magic == DB_LOG_MAGIC) && ((int32_t)(h1->seq - h0->seq) > 0)))
+            h0 = h1;
+        db_sector = (uint32_t)h0;
+        db_seq = h0->seq;
+        db_replay(db_sector, (uint8_t *)db, max_size);
+    }
+    else
+    {
+        // database written as a whole by earlier versions (or blank flash)
+        memcpy(db, (void *)DB_FLASH_ADDRESS, max_size);
+        db_sector = DB_FLASH_ADDRESS;
+        db_seq = 0;
+        db_need_compact = 1;
+    }
+
+    memcpy(db_shadow, db, max_size);
     return KV_OK;
 }
 
@@ -142,6 +628,14 @@ uint32_t uart0_isr(void *user_data)
         // rx int
         if (status & (1 << bsUART_RECEIVE_INTENAB))
         {
+            uart_last_active = platform_get_us_time();
+            if (wakeup_time)
+            {
+                // first byte since host woke us up
+                wake_to_rx_last = (uint32_t)(uart_last_active - wakeup_time);
+                if (wake_to_rx_last > wake_to_rx_max) wake_to_rx_max = wake_to_rx_last;
+                wakeup_time = 0;
+            }
             while (apUART_Check_RXFIFO_EMPTY(APB_UART0) != 1)
             {
                 char c = APB_UART0->DataRead;
@@ -10,9 +10,15 @@
 #include "ingsoc.h"
 #include "platform_api.h"
 #include "att_db.h"
+#include "btstack_event.h"
 #include "ota_service.h"
 #include "rom_tools.h"
 #include "eflash.h"
+#include "kv_storage.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
 
 prog_ver_t prog_ver = { .major = 1, .minor = 0, .patch = 0 };
 
@@ -22,132 +28,828 @@ prog_ver_t prog_ver = { .major = 1, .minor = 0, .patch = 0 };
 #define ATT_OTA_HANDLE_VER          HANDLE_FOTA_VERSION
 #define ATT_OTA_HANDLE_DATA         HANDLE_FOTA_DATA
 #define ATT_OTA_HANDLE_CTRL         HANDLE_FOTA_CONTROL
+#define ATT_OTA_HANDLE_STATUS       HANDLE_FOTA_STATUS
+#define ATT_OTA_HANDLE_STATUS_CCCD  HANDLE_FOTA_STATUS_CLIENT_CHAR_CONFIG
+
+#ifndef OTA_PAGE_BUFFER_NUM
+#define OTA_PAGE_BUFFER_NUM         3
+#endif
+
+// flash region readable through FOTA_DATA (kv storage is always excluded)
+#ifndef OTA_READ_REGION_START
+#if (INGCHIPS_FAMILY == INGCHIPS_FAMILY_916)
+#define OTA_READ_REGION_START       0x2000000
+#define OTA_READ_REGION_END         0x2100000
+#elif (INGCHIPS_FAMILY == INGCHIPS_FAMILY_918)
+#define OTA_READ_REGION_START       0x4000
+#define OTA_READ_REGION_END         0x84000
+#endif
+#endif
+
+// maximum length of an attribute value (ATT)
+#define OTA_READ_MAX_LEN            512
+
+// progress of resumable OTA is committed to kv storage every N pages
+#ifndef OTA_PROGRESS_COMMIT_PAGES
+#define OTA_PROGRESS_COMMIT_PAGES   4
+#endif
 
 static uint8_t  ota_ctrl[] = {OTA_STATUS_DISABLED};
 static uint8_t  ota_downloading = 0;
 static uint32_t ota_start_addr = 0;
 static uint32_t ota_page_offset = 0;
-static uint8_t  page_buffer[PAGE_SIZE];
+static uint32_t ota_read_len = 0;       // length of FOTA_DATA value after OTA_CTRL_READ_PAGE
 
+// Pages are programmed by `ota_program_task`, so that the next page can
+// be received while the previous one is being erased and programmed.
+typedef struct ota_page
+{
+    uint32_t addr;
+    uint16_t size;
+    uint8_t  crc32;         // `crc_value` is CRC-32 instead of `crc()`
+    uint8_t  session;       // `ota_session` when queued
+    uint32_t crc_value;
+    uint8_t  data[PAGE_SIZE];
+} ota_page_t;
 
-int ota_write_callback(uint16_t att_handle, uint16_t transaction_mode, uint16_t offset, const uint8_t *buffer, uint16_t buffer_size)
+static ota_page_t pages[OTA_PAGE_BUFFER_NUM];
+
+// Streaming decoder of LZ4 block format. Each page is compressed on its
+// own, so the page buffer itself is the window and only this state is
+// kept between writes.
+enum
 {
-    if (transaction_mode != ATT_TRANSACTION_MODE_NONE)
+    LZ4_TOKEN,
+    LZ4_LITERAL_LEN,
+    LZ4_LITERALS,
+    LZ4_OFFSET_LO,
+    LZ4_OFFSET_HI,
+    LZ4_MATCH_LEN,
+    LZ4_ERROR,
+};
+
+static struct
+{
+    uint8_t  enabled;
+    uint8_t  state;
+    uint16_t offset;
+    uint32_t literal_len;
+    uint32_t match_len;
+} lz4 = {0};
+
+static void lz4_reset(uint8_t enabled)
+{
+    lz4.enabled = enabled;
+    lz4.state = LZ4_TOKEN;
+}
+
+static int lz4_copy_match(uint8_t *out, uint32_t *pos)
+{
+    uint32_t len = lz4.match_len + 4;
+    uint32_t i;
+    if ((lz4.offset == 0) || (lz4.offset > *pos) || (*pos + len > PAGE_SIZE))
+        return -1;
+    // byte by byte, as source and destination may overlap
+    for (i = 0; i < len; i++, (*pos)++)
+        out[*pos] = out[*pos - lz4.offset];
+    return 0;
+}
+
+// returns 0 if OK
+static int lz4_decode(const uint8_t *in, int size, uint8_t *out, uint32_t *pos)
+{
+    while (size > 0)
+    {
+        uint8_t b;
+        switch (lz4.state)
+        {
+        case LZ4_TOKEN:
+            b = *in++; size--;
+            lz4.literal_len = b >> 4;
+            lz4.match_len = b & 0xf;
+            lz4.state = lz4.literal_len == 15 ? LZ4_LITERAL_LEN :
+                        lz4.literal_len > 0 ? LZ4_LITERALS : LZ4_OFFSET_LO;
+            break;
+        case LZ4_LITERAL_LEN:
+            b = *in++; size--;
+            lz4.literal_len += b;
+            if (b != 255) lz4.state = LZ4_LITERALS;
+            break;
+        case LZ4_LITERALS:
+            {
+                uint32_t n = lz4.literal_len < size ? lz4.literal_len : size;
+                if (*pos + n > PAGE_SIZE)
+                    goto error;
+                memcpy(out + *pos, in, n);
+                *pos += n; in += n; size -= n;
+                lz4.literal_len -= n;
+                if (0 == lz4.literal_len) lz4.state = LZ4_OFFSET_LO;
+            }
+            break;
+        case LZ4_OFFSET_LO:
+            lz4.offset = *in++; size--;
+            lz4.state = LZ4_OFFSET_HI;
+            break;
+        case LZ4_OFFSET_HI:
+            lz4.offset |= *in++ << 8; size--;
+            if (lz4.match_len == 15)
+                lz4.state = LZ4_MATCH_LEN;
+            else
+            {
+                if (lz4_copy_match(out, pos)) goto error;
+                lz4.state = LZ4_TOKEN;
+            }
+            break;
+        case LZ4_MATCH_LEN:
+            b = *in++; size--;
+            lz4.match_len += b;
+            if (b != 255)
+            {
+                if (lz4_copy_match(out, pos)) goto error;
+                lz4.state = LZ4_TOKEN;
+            }
+            break;
+        default:
+            goto error;
+        }
+    }
+    return 0;
+
+error:
+    lz4.state = LZ4_ERROR;
+    return -1;
+}
+
+static const uint32_t crc32_table[256] =
+{
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+// CRC-32 (IEEE 802.3), as zlib.crc32
+static uint32_t ota_crc32(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+    crc = ~crc;
+    while (len--)
+        crc = crc32_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static ota_page_t *page = NULL;         // page being received
+static QueueHandle_t free_pages;
+static QueueHandle_t pending_pages;
+static SemaphoreHandle_t flash_mutex = NULL;
+static volatile uint8_t ota_prog_error = 0;
+static uint8_t ota_session = 0;         // results of pages queued by an earlier session are ignored
+
+// Windowed mode: the client keeps up to `OTA_WINDOW_SIZE` pages in flight
+// and learns the result of each page from notifications.
+#define OTA_WINDOW_SIZE             (OTA_PAGE_BUFFER_NUM > 1 ? OTA_PAGE_BUFFER_NUM - 1 : 1)
+#define OTA_NOTIFY_QUEUE_SIZE       (OTA_PAGE_BUFFER_NUM + 2)
+
+static uint8_t  ota_windowed = 0;
+static uint16_t ota_seq = 0;
+static uint8_t  ota_seq_error = 0;
+static uint16_t ota_conn_handle = 0;
+static uint16_t ota_cccd = 0;
+
+static ota_notify_t notify_queue[OTA_NOTIFY_QUEUE_SIZE];
+static uint8_t notify_head = 0;
+static uint8_t notify_num = 0;
+
+static void flush_notifications(void)
+{
+    while (notify_num > 0)
+    {
+        if (att_server_notify(ota_conn_handle, ATT_OTA_HANDLE_STATUS,
+                              (uint8_t *)(notify_queue + notify_head), sizeof(ota_notify_t)) != 0)
+        {
+            att_server_request_can_send_now_event(ota_conn_handle);
+            return;
+        }
+        notify_head = (notify_head + 1) % OTA_NOTIFY_QUEUE_SIZE;
+        notify_num--;
+    }
+}
+
+static void ota_notify(uint8_t status, uint8_t ctrl, uint32_t param)
+{
+    ota_notify_t *n;
+    if ((0 == ota_windowed) || (0 == (ota_cccd & 1)))
+        return;
+    // the window keeps the queue from being full; drop it just in case
+    if (notify_num >= OTA_NOTIFY_QUEUE_SIZE)
+        return;
+
+    n = notify_queue + (notify_head + notify_num) % OTA_NOTIFY_QUEUE_SIZE;
+    n->status = status;
+    n->ctrl = ctrl;
+    n->param = param;
+    notify_num++;
+    flush_notifications();
+}
+
+void ota_on_can_send_now(void)
+{
+    flush_notifications();
+}
+
+// Resumable mode: bits of the bitmap are changed and committed in stack
+// context only, as kv storage is not thread-safe. Flash writes of kv storage
+// are serialized against page programming by ota_flash_lock().
+static uint8_t ota_resumable = 0;
+static uint8_t ota_query = 0;          // OTA_CTRL_xxx whose result is appended to CONTROL reads
+static uint8_t uncommitted_pages = 0;
+static ota_progress_t progress = {0};
+
+static int progress_page_index(uint32_t addr)
+{
+    uint32_t n;
+    if ((0 == ota_resumable) || (addr < progress.base))
+        return -1;
+    n = (addr - progress.base) / PAGE_SIZE;
+    if ((addr - progress.base) % PAGE_SIZE || (n >= progress.page_num))
+        return -1;
+    return n;
+}
+
+static void commit_progress(void)
+{
+    kv_put(KV_KEY_OTA, (const uint8_t *)&progress, sizeof(progress));
+    kv_commit(1);
+    uncommitted_pages = 0;
+}
+
+static void update_progress(uint32_t addr, int done)
+{
+    int n = progress_page_index(addr);
+    if (n < 0) return;
+    if (done)
+    {
+        progress.bitmap[n >> 3] |= 1 << (n & 7);
+        if (++uncommitted_pages >= OTA_PROGRESS_COMMIT_PAGES)
+            commit_progress();
+    }
+    else if (progress.bitmap[n >> 3] & (1 << (n & 7)))
+    {
+        // persisted before the page is erased, so that an interrupted
+        // programming is not taken as done after reset
+        progress.bitmap[n >> 3] &= ~(1 << (n & 7));
+        commit_progress();
+    }
+}
+
+// a page is programmed by `ota_program_task`, and already freed
+static void stack_page_programmed(void *user_data, uint16_t value)
+{
+    uint32_t addr = (uint32_t)(uintptr_t)user_data;
+    uint8_t status = value & 0xff;
+
+    if ((value >> 8) == ota_session)
+    {
+        if (OTA_STATUS_OK == status)
+            update_progress(addr, 1);
+        ota_notify(status, OTA_CTRL_PAGE_END, addr);
+    }
+
+    // the rejected command can be retried now
+    if (OTA_STATUS_BUSY == ota_ctrl[0])
+    {
+        ota_ctrl[0] = OTA_STATUS_OK;
+        ota_notify(OTA_STATUS_OK, OTA_NOTIFY_READY, uxQueueMessagesWaiting(free_pages));
+    }
+}
+
+static int start_resumable(const uint8_t *param, uint16_t size)
+{
+    int16_t len;
+    const ota_progress_t *saved;
+
+    if (size < 10) return -1;
+
+    progress.image_id = *(uint32_t *)(param + 0);
+    progress.base     = *(uint32_t *)(param + 4);
+    progress.page_num = *(uint16_t *)(param + 8);
+    if ((progress.base % PAGE_SIZE) || (progress.page_num > OTA_MAX_PAGES))
+        return -1;
+
+    saved = (const ota_progress_t *)kv_get(KV_KEY_OTA, &len);
+    if (   saved && (len == sizeof(progress))
+        && (saved->image_id == progress.image_id)
+        && (saved->base == progress.base)
+        && (saved->page_num == progress.page_num))
+        memcpy(progress.bitmap, saved->bitmap, sizeof(progress.bitmap));
+    else
+    {
+        memset(progress.bitmap, 0, sizeof(progress.bitmap));
+        commit_progress();
+    }
+    uncommitted_pages = 0;
+    return 0;
+}
+
+// OTA_CTRL_HASH_REGION: queued to `ota_program_task` as a NULL page, so
+// that it runs after pending pages are programmed.
+static uint32_t hash_addr = 0;
+static uint32_t hash_len = 0;
+static uint32_t hash_value = 0;
+static volatile uint8_t hash_busy = 0;
+
+static void stack_notify_hash(void *value, uint16_t b)
+{
+    ota_notify(OTA_STATUS_OK, OTA_CTRL_HASH_REGION, (uint32_t)(uintptr_t)value);
+}
+
+static void hash_region(void)
+{
+    uint32_t crc_value = 0;
+    uint32_t addr = hash_addr;
+    uint32_t remain = hash_len;
+
+    // yield between blocks, so that a long region does not starve other tasks
+    while (remain > 0)
+    {
+        uint32_t n = remain > PAGE_SIZE ? PAGE_SIZE : remain;
+        crc_value = ota_crc32(crc_value, (const uint8_t *)addr, n);
+        addr += n;
+        remain -= n;
+        taskYIELD();
+    }
+    hash_value = crc_value;
+    hash_busy = 0;
+    btstack_push_user_runnable(stack_notify_hash, (void *)(uintptr_t)crc_value, 0);
+}
+
+static int is_readable(uint32_t addr, uint32_t len)
+{
+    if ((addr < OTA_READ_REGION_START) || (addr > OTA_READ_REGION_END)
+        || (len > OTA_READ_REGION_END - addr))
         return 0;
+    // bonding keys and settings must not leak to peers
+    return (addr + len <= DB_FLASH_ADDRESS) || (addr >= DB_FLASH_ADDRESS + DB_FLASH_SIZE);
+}
 
-    if (att_handle == ATT_OTA_HANDLE_CTRL)
+static uint8_t program_page(const ota_page_t *p)
+{
+    uint32_t crc_value;
+    ota_flash_lock();
+    program_flash(p->addr, p->data, p->size);
+    ota_flash_unlock();
+    crc_value = p->crc32 ? ota_crc32(0, (const uint8_t *)p->addr, p->size)
+                         : crc((uint8_t *)p->addr, p->size);
+    return crc_value == p->crc_value ? OTA_STATUS_OK : OTA_STATUS_ERROR;
+}
+
+static void ota_program_task(void *pdata)
+{
+    ota_page_t *p;
+    for (;;)
     {
+        uint8_t status;
+        uint32_t addr;
+        uint8_t session;
+        xQueueReceive(pending_pages, &p, portMAX_DELAY);
+
+        if (NULL == p)
+        {
+            hash_region();
+            continue;
+        }
+
+        status = program_page(p);
+        if (OTA_STATUS_OK != status)
+            ota_prog_error = 1;
+        addr = p->addr;
+        session = p->session;
+        xQueueSend(free_pages, &p, 0);
+
+        // progress is updated in stack context
+        btstack_push_user_runnable(stack_page_programmed, (void *)(uintptr_t)addr,
+                                   status | (session << 8));
+    }
+}
+
+void ota_flash_lock(void)
+{
+    if (flash_mutex) xSemaphoreTake(flash_mutex, portMAX_DELAY);
+}
+
+void ota_flash_unlock(void)
+{
+    if (flash_mutex) xSemaphoreGive(flash_mutex);
+}
+
+// never blocks the stack: NULL if all pages are being programmed
+static ota_page_t *alloc_page(void)
+{
+    ota_page_t *p;
+    return xQueueReceive(free_pages, &p, 0) == pdTRUE ? p : NULL;
+}
+
+static void release_page(void)
+{
+    if (NULL == page) return;
+    xQueueSend(free_pages, &page, portMAX_DELAY);
+    page = NULL;
+}
+
+// in windowed mode, commands that need all pending pages programmed are
+// rejected with OTA_STATUS_BUSY otherwise, and retried after OTA_NOTIFY_READY
+static int pages_programmed(void)
+{
+    return uxQueueMessagesWaiting(free_pages) + (page ? 1 : 0) >= OTA_PAGE_BUFFER_NUM;
+}
+
+// OTA_CTRL_START blocks like the original protocol, until pages queued by
+// an earlier windowed session are programmed
+static void wait_pages_programmed(void)
+{
+    while (!pages_programmed())
+        vTaskDelay(1);
+}
+
+void ota_init(void)
+{
+    int i;
+    flash_mutex = xSemaphoreCreateMutex();
+    free_pages = xQueueCreate(OTA_PAGE_BUFFER_NUM, sizeof(ota_page_t *));
+    // one more for OTA_CTRL_HASH_REGION
+    pending_pages = xQueueCreate(OTA_PAGE_BUFFER_NUM + 1, sizeof(ota_page_t *));
+    for (i = 0; i < OTA_PAGE_BUFFER_NUM; i++)
+    {
+        ota_page_t *p = pages + i;
+        xQueueSend(free_pages, &p, 0);
+    }
+
+    xTaskCreate(ota_program_task,
+           "o",
+           configMINIMAL_STACK_SIZE,
+           NULL,
+           tskIDLE_PRIORITY + 1,
+           NULL);
+}
+
+
+void ota_write_ctrl(const uint8_t *buffer, uint16_t buffer_size)
+{
+    ota_query = 0;
+
+    if (   (OTA_CTRL_START == buffer[0]) || (OTA_CTRL_START_WINDOWED == buffer[0])
+        || (OTA_CTRL_START_RESUMABLE == buffer[0]))
+    {
+        release_page();
         if (OTA_CTRL_START == buffer[0])
+            wait_pages_programmed();
+        else if (!pages_programmed())
         {
-            ota_ctrl[0] = OTA_STATUS_OK;
-            ota_start_addr = 0;
-            ota_downloading = 0;
-            return 0;
+            ota_ctrl[0] = OTA_STATUS_BUSY;
+            ota_notify(OTA_STATUS_BUSY, buffer[0], 0);
+            return;
+        }
+        if (ota_resumable && uncommitted_pages)
+            commit_progress();
+        ota_session++;
+        ota_resumable = 0;
+        ota_prog_error = 0;
+        ota_ctrl[0] = OTA_STATUS_OK;
+        ota_start_addr = 0;
+        ota_downloading = 0;
+        notify_num = 0;
+        ota_windowed = OTA_CTRL_START == buffer[0] ? 0 : 1;
+        if (OTA_CTRL_START_RESUMABLE == buffer[0])
+        {
+            if (start_resumable(buffer + 1, buffer_size - 1) == 0)
+                ota_resumable = 1;
+            else
+                ota_ctrl[0] = OTA_STATUS_ERROR;
         }
+        ota_notify(ota_ctrl[0], buffer[0], OTA_WINDOW_SIZE);
+        return;
+    }
 
-        switch (buffer[0])
+    switch (buffer[0])
+    {
+    case OTA_CTRL_PAGE_BEGIN:
+    case OTA_CTRL_PAGE_BEGIN_LZ4:
+        lz4_reset(OTA_CTRL_PAGE_BEGIN_LZ4 == buffer[0]);
+        ota_start_addr = *(uint32_t *)(buffer + 1);
+        if ((ota_start_addr & 0x3) || ota_prog_error)
+        {
+            ota_ctrl[0] = OTA_STATUS_ERROR;
+            break;
+        }
+        if (NULL == page)
+            page = alloc_page();
+        if (NULL == page)
+        {
+            ota_ctrl[0] = ota_windowed ? OTA_STATUS_BUSY : OTA_STATUS_ERROR;
+            break;
+        }
+        ota_ctrl[0] = OTA_STATUS_OK;
+        ota_downloading = 1;
+        ota_page_offset = 0;
+        ota_seq = 0;
+        ota_seq_error = 0;
+        break;
+    case OTA_CTRL_PAGE_END:
+    case OTA_CTRL_PAGE_END_CRC32:
+        ota_downloading = 0;
+        if (NULL == page)
+        {
+            ota_ctrl[0] = OTA_STATUS_ERROR;
+            break;
+        }
         {
-        case OTA_CTRL_PAGE_BEGIN:
-            ota_start_addr = *(uint32_t *)(buffer + 1);
-            if (ota_start_addr & 0x3)
+            uint16_t len = *(uint16_t *)(buffer + 1);
+            uint32_t crc_value = OTA_CTRL_PAGE_END == buffer[0] ? *(uint16_t *)(buffer + 3)
+                                                                : *(uint32_t *)(buffer + 3);
+            if (ota_page_offset < len)
             {
-                ota_ctrl[0] = OTA_STATUS_ERROR;
-                return 0;
+                release_page();
+                ota_ctrl[0] = OTA_STATUS_WAIT_DATA;
+                break;
             }
-            else
-                ota_ctrl[0] = OTA_STATUS_OK;
-            ota_downloading = 1;
-            ota_page_offset = 0;
-            break;
-        case OTA_CTRL_PAGE_END:
-            program_flash(ota_start_addr, page_buffer, ota_page_offset);
 
-            ota_downloading = 0;
+            page->addr = ota_start_addr;
+            page->size = len;
+            page->crc_value = crc_value;
+            page->crc32 = OTA_CTRL_PAGE_END_CRC32 == buffer[0];
+            page->session = ota_session;
+
+            if (0 == ota_windowed)
             {
-                uint16_t len = *(uint16_t *)(buffer + 1);
-                uint16_t crc_value = *(uint16_t *)(buffer + 3);
-                if (ota_page_offset < len)
-                {
-                    ota_ctrl[0] = OTA_STATUS_WAIT_DATA;
-                    break;
-                }
-
-                if (crc((uint8_t *)ota_start_addr, len) != crc_value)
-                    ota_ctrl[0] = OTA_STATUS_ERROR;
-                else
-                    ota_ctrl[0] = OTA_STATUS_OK;
+                // the original protocol: the result is of this very page
+                ota_ctrl[0] = program_page(page);
+                release_page();
+                break;
             }
-            break;
-        case OTA_CTRL_READ_PAGE:
-            if (ota_downloading)
+
+            // CRC is checked after programming, and the result is notified
+            update_progress(page->addr, 0);
+            xQueueSend(pending_pages, &page, portMAX_DELAY);
+            page = NULL;
+
+            ota_ctrl[0] = ota_prog_error ? OTA_STATUS_ERROR : OTA_STATUS_OK;
+        }
+        break;
+    case OTA_CTRL_READ_PAGE:
+        {
+            uint32_t addr = *(uint32_t *)(buffer + 1);
+            uint32_t len = buffer_size >= 9 ? *(uint32_t *)(buffer + 5) : OTA_READ_MAX_LEN;
+            if (ota_downloading || (len > OTA_READ_MAX_LEN) || !is_readable(addr, len))
+            {
                 ota_ctrl[0] = OTA_STATUS_ERROR;
-            else
+                ota_read_len = 0;
+                break;
+            }
+            ota_start_addr = addr;
+            ota_read_len = len;
+            ota_ctrl[0] = OTA_STATUS_OK;
+        }
+        break;
+    case OTA_CTRL_HASH_REGION:
+        {
+            ota_page_t *job = NULL;
+            uint32_t addr = *(uint32_t *)(buffer + 1);
+            uint32_t len = buffer_size >= 9 ? *(uint32_t *)(buffer + 5) : 0;
+            if (ota_downloading || hash_busy || (0 == len) || !is_readable(addr, len))
             {
-                ota_start_addr = *(uint32_t *)(buffer + 1);
-                ota_ctrl[0] = OTA_STATUS_OK;
+                ota_ctrl[0] = OTA_STATUS_ERROR;
+                break;
             }
+            hash_addr = addr;
+            hash_len = len;
+            hash_busy = 1;
+            ota_query = OTA_CTRL_HASH_REGION;
+            ota_ctrl[0] = OTA_STATUS_OK;
+            xQueueSend(pending_pages, &job, portMAX_DELAY);
+        }
+        break;
+    case OTA_CTRL_QUERY_PAGES:
+        if (ota_downloading || (0 == ota_resumable))
+            ota_ctrl[0] = OTA_STATUS_ERROR;
+        else
+        {
+            // bits of pages still being programmed are not set yet
+            ota_ctrl[0] = OTA_STATUS_OK;
+            ota_query = OTA_CTRL_QUERY_PAGES;
+        }
+        break;
+    case OTA_CTRL_METADATA:
+        if (OTA_STATUS_OK != ota_ctrl[0])
             break;
-        case OTA_CTRL_METADATA:
-            if (OTA_STATUS_OK != ota_ctrl[0])
+        if ((0 == ota_downloading) || (buffer_size < 1 + sizeof(ota_meta_t)))
+        {
+            const ota_meta_t  *meta = (const ota_meta_t *)(buffer + 1);
+            int s = buffer_size - 1;
+            if (crc((uint8_t *)&meta->entry, s - sizeof(meta->crc_value)) != meta->crc_value)
+            {
+                ota_ctrl[0] = OTA_STATUS_ERROR;
                 break;
-            if ((0 == ota_downloading) || (buffer_size < 1 + sizeof(ota_meta_t)))
+            }
+            release_page();
+            if (!pages_programmed())
             {
-                const ota_meta_t  *meta = (const ota_meta_t *)(buffer + 1);
-                int s = buffer_size - 1;
-                if (crc((uint8_t *)&meta->entry, s - sizeof(meta->crc_value)) != meta->crc_value)
-                {
-                    ota_ctrl[0] = OTA_STATUS_ERROR;
-                    break;
-                }
-                flash_do_update((s - sizeof(ota_meta_t)) / sizeof(meta->blocks[0]),
-                                meta->blocks,
-                                page_buffer);
+                ota_ctrl[0] = OTA_STATUS_BUSY;
+                break;
             }
-            else
+            if (ota_prog_error)
             {
                 ota_ctrl[0] = OTA_STATUS_ERROR;
+                break;
             }
-            break;
-        case OTA_CTRL_REBOOT:
-            if (OTA_STATUS_OK == ota_ctrl[0])
+            if (ota_resumable)
             {
-                if (ota_downloading)
-                    ota_ctrl[0] = OTA_STATUS_ERROR;
-                else
-                    platform_reset();
+                // the image is complete, and progress is no longer needed
+                kv_remove(KV_KEY_OTA);
+                kv_commit(1);
+                ota_resumable = 0;
             }
-            break;
-        default:
+            // all pages are free now, borrow one as the working buffer
+            flash_do_update((s - sizeof(ota_meta_t)) / sizeof(meta->blocks[0]),
+                            meta->blocks,
+                            pages[0].data);
+        }
+        else
+        {
             ota_ctrl[0] = OTA_STATUS_ERROR;
         }
-    }
-    else if (att_handle == ATT_OTA_HANDLE_DATA)
-    {
+        break;
+    case OTA_CTRL_REBOOT:
         if (OTA_STATUS_OK == ota_ctrl[0])
         {
-            if (   (buffer_size & 0x3) || (0 == ota_downloading)
-                || (ota_page_offset + buffer_size > PAGE_SIZE))
-            {
+            if (ota_downloading)
                 ota_ctrl[0] = OTA_STATUS_ERROR;
-                return 0;
-            }
+            else if (!pages_programmed())
+                ota_ctrl[0] = OTA_STATUS_BUSY;
+            else
+                platform_reset();
+        }
+        break;
+    default:
+        ota_ctrl[0] = OTA_STATUS_ERROR;
+    }
+
+    // result of a completed page is notified after it is programmed
+    if ((ota_ctrl[0] != OTA_STATUS_OK) || (OTA_CTRL_METADATA == buffer[0]))
+        ota_notify(ota_ctrl[0], buffer[0], ota_start_addr);
+}
+
+void ota_write_data(const uint8_t *buffer, uint16_t buffer_size)
+{
+    if (OTA_STATUS_OK != ota_ctrl[0])
+        return;
+
+    if (ota_windowed)
+    {
+        uint16_t seq = (buffer_size >= 2) ? buffer[0] | (buffer[1] << 8) : ota_seq + 1;
+        if (seq != ota_seq)
+        {
+            // report once, then drop data until the expected one is resent
+            if (0 == ota_seq_error)
+                ota_notify(OTA_STATUS_SEQ_ERROR, OTA_NOTIFY_DATA, ota_seq);
+            ota_seq_error = 1;
+            return;
+        }
+        ota_seq_error = 0;
+        ota_seq++;
+        buffer += 2;
+        buffer_size -= 2;
+    }
 
-            memcpy(page_buffer + ota_page_offset,
-                   buffer, buffer_size);
-            ota_page_offset += buffer_size;
+    if (lz4.enabled && ota_downloading)
+    {
+        // `ota_page_offset` counts decompressed bytes
+        if (lz4_decode(buffer, buffer_size, page->data, &ota_page_offset) != 0)
+        {
+            ota_ctrl[0] = OTA_STATUS_ERROR;
+            ota_notify(OTA_STATUS_ERROR, OTA_NOTIFY_DATA, ota_page_offset);
         }
+        return;
     }
+
+    if (   (buffer_size & 0x3) || (0 == ota_downloading)
+        || (ota_page_offset + buffer_size > PAGE_SIZE))
+    {
+        ota_ctrl[0] = OTA_STATUS_ERROR;
+        ota_notify(OTA_STATUS_ERROR, OTA_NOTIFY_DATA, ota_page_offset);
+        return;
+    }
+
+    memcpy(page->data + ota_page_offset,
+           buffer, buffer_size);
+    ota_page_offset += buffer_size;
+}
+
+void ota_get_progress(uint8_t *status, uint32_t *page_addr, uint32_t *page_offset)
+{
+    *status = (ota_prog_error && (OTA_STATUS_OK == ota_ctrl[0])) ? OTA_STATUS_ERROR : ota_ctrl[0];
+    *page_addr = ota_start_addr;
+    *page_offset = ota_downloading ? ota_page_offset : 0;
+}
+
+int ota_write_callback(uint16_t conn_handle, uint16_t att_handle, uint16_t transaction_mode, uint16_t offset, const uint8_t *buffer, uint16_t buffer_size)
+{
+    if (transaction_mode != ATT_TRANSACTION_MODE_NONE)
+        return 0;
+
+    if (att_handle == ATT_OTA_HANDLE_STATUS_CCCD)
+    {
+        if (buffer_size >= 2)
+            ota_cccd = buffer[0] | (buffer[1] << 8);
+        ota_conn_handle = conn_handle;
+    }
+    else if (att_handle == ATT_OTA_HANDLE_CTRL)
+    {
+        ota_conn_handle = conn_handle;
+        ota_write_ctrl(buffer, buffer_size);
+    }
+    else if (att_handle == ATT_OTA_HANDLE_DATA)
+        ota_write_data(buffer, buffer_size);
     else;
 
     return 0;
 }
 
+// CONTROL value: status, followed by the result of OTA_CTRL_QUERY_PAGES
+// or OTA_CTRL_HASH_REGION
+static int ctrl_value(uint8_t *value)
+{
+    if (ota_prog_error && (OTA_STATUS_OK == ota_ctrl[0]))
+        ota_ctrl[0] = OTA_STATUS_ERROR;
+    value[0] = ota_ctrl[0];
+    switch (ota_query)
+    {
+    case OTA_CTRL_QUERY_PAGES:
+        memcpy(value + 1, &progress, sizeof(progress));
+        return 1 + sizeof(progress);
+    case OTA_CTRL_HASH_REGION:
+        if (hash_busy)
+        {
+            value[0] = OTA_STATUS_WAIT_DATA;
+            return 1;
+        }
+        memcpy(value + 1, &hash_value, sizeof(hash_value));
+        return 1 + sizeof(hash_value);
+    default:
+        return 1;
+    }
+}
+
 int ota_read_callback(uint16_t att_handle, uint16_t offset, uint8_t * buffer, uint16_t buffer_size)
 {
     if (buffer == NULL)
     {
         if (att_handle == ATT_OTA_HANDLE_CTRL)
-            return 1;
+        {
+            uint8_t value[1 + sizeof(progress)];
+            return ctrl_value(value);
+        }
+        else if (att_handle == ATT_OTA_HANDLE_DATA)
+            return ota_read_len;
+        else if (att_handle == ATT_OTA_HANDLE_STATUS_CCCD)
+            return sizeof(ota_cccd);
         else if (att_handle == ATT_OTA_HANDLE_VER)
             return sizeof(ota_ver_t);
         else
@@ -156,7 +858,27 @@ int ota_read_callback(uint16_t att_handle, uint16_t offset, uint8_t * buffer, ui
 
     if (att_handle == ATT_OTA_HANDLE_CTRL)
     {
-        buffer[0] = ota_ctrl[0];
+        // may be read with Read Blob if longer than MTU
+        uint8_t value[1 + sizeof(progress)];
+        int len = ctrl_value(value) - offset;
+        if (len <= 0) return 0;
+        if (len > buffer_size) len = buffer_size;
+        memcpy(buffer, value + offset, len);
+        return len;
+    }
+    else if (att_handle == ATT_OTA_HANDLE_DATA)
+    {
+        // flash is memory mapped, and copied directly into the response
+        int len = (int)ota_read_len - offset;
+        if (len <= 0) return 0;
+        if (len > buffer_size) len = buffer_size;
+        memcpy(buffer, (const uint8_t *)ota_start_addr + offset, len);
+        return len;
+    }
+    else if (att_handle == ATT_OTA_HANDLE_STATUS_CCCD)
+    {
+        buffer[0] = ota_cccd & 0xff;
+        buffer[1] = ota_cccd >> 8;
     }
     else if (att_handle == ATT_OTA_HANDLE_VER)
     {
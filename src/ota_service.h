@@ -33,10 +33,24 @@ typedef struct ota_meta
 } ota_meta_t;
 #pragma pack (pop)
 
+// kv storage, two sectors (see main.c)
+#if (INGCHIPS_FAMILY == INGCHIPS_FAMILY_916)
+    #define DB_FLASH_ADDRESS  0x2040000
+#elif (INGCHIPS_FAMILY == INGCHIPS_FAMILY_918)
+    #define DB_FLASH_ADDRESS  0x40000
+#endif
+#define DB_FLASH_SIZE       (2 * EFLASH_ERASABLE_SIZE)
+
 #define OTA_CTRL_START              0xAA // param: no
+#define OTA_CTRL_START_WINDOWED     0xAB // param: no. DATA is prefixed by sequence number (16bit), status is notified
+#define OTA_CTRL_START_RESUMABLE    0xAC // param: image id (32 bit), base address (32 bit), page number (16 bit). windowed, with persisted progress
 #define OTA_CTRL_PAGE_BEGIN         0xB0 // param: page address (32 bit), following DATA contains the data
 #define OTA_CTRL_PAGE_END           0xB1 // param: size (16bit), crc (16bit)
-#define OTA_CTRL_READ_PAGE          0xC0 // param: page address, following DATA reading contains the data
+#define OTA_CTRL_PAGE_BEGIN_LZ4     0xB2 // param: page address (32 bit), following DATA contains the page compressed in LZ4 block format
+#define OTA_CTRL_PAGE_END_CRC32     0xB3 // param: size (16bit), crc (CRC-32, 32bit)
+#define OTA_CTRL_READ_PAGE          0xC0 // param: address, [length (32 bit), default and maximum 512], following DATA reading contains the data
+#define OTA_CTRL_QUERY_PAGES        0xC1 // param: no. following CONTROL reading contains status and ota_progress_t
+#define OTA_CTRL_HASH_REGION        0xC2 // param: address (32 bit), length (32 bit). following CONTROL reading contains status and CRC-32 (32 bit)
 #define OTA_CTRL_SWITCH_APP         0xD0 // param: no
 #define OTA_CTRL_METADATA           0xE0 // param: ota_meta_t
 #define OTA_CTRL_REBOOT             0xFF // param: no
@@ -45,8 +59,54 @@ typedef struct ota_meta
 #define OTA_STATUS_OK               1
 #define OTA_STATUS_ERROR            2
 #define OTA_STATUS_WAIT_DATA        3
+#define OTA_STATUS_SEQ_ERROR        4
+#define OTA_STATUS_BUSY             5 // all page buffers are in use, retry when notified by OTA_NOTIFY_READY
+
+// notified on FOTA_STATUS in windowed mode
+#define OTA_NOTIFY_DATA             0x00 // `ctrl` of notifications about DATA
+#define OTA_NOTIFY_READY            0x01 // `ctrl` of notification that a page buffer is free after OTA_STATUS_BUSY
+
+#pragma pack (push, 1)
+typedef struct ota_notify
+{
+    uint8_t  status;
+    uint8_t  ctrl;      // OTA_CTRL_xxx, or OTA_NOTIFY_DATA
+    uint32_t param;     // window size, page address, expected sequence number, or free page buffers
+} ota_notify_t;
+#pragma pack (pop)
+
+#ifndef OTA_MAX_PAGES
+#define OTA_MAX_PAGES               256
+#endif
 
-int ota_write_callback(uint16_t att_handle, uint16_t transaction_mode, uint16_t offset, const uint8_t *buffer, uint16_t buffer_size);
+// kv storage key of resumable OTA progress
+#ifndef KV_KEY_OTA
+#define KV_KEY_OTA                  (KV_USER_KEY_START + 0x20)
+#endif
+
+#pragma pack (push, 1)
+typedef struct ota_progress
+{
+    uint32_t image_id;
+    uint32_t base;
+    uint16_t page_num;
+    uint8_t  bitmap[(OTA_MAX_PAGES + 7) / 8]; // bit n: page at `base + n * page size` is programmed and verified
+} ota_progress_t;
+#pragma pack (pop)
+
+void ota_init(void);
+
+int ota_write_callback(uint16_t conn_handle, uint16_t att_handle, uint16_t transaction_mode, uint16_t offset, const uint8_t *buffer, uint16_t buffer_size);
 int ota_read_callback(uint16_t att_handle, uint16_t offset, uint8_t * buffer, uint16_t buffer_size);
+void ota_on_can_send_now(void);
+
+// used by OTA over UART: same as writing to FOTA_CONTROL and FOTA_DATA
+void ota_write_ctrl(const uint8_t *buffer, uint16_t buffer_size);
+void ota_write_data(const uint8_t *buffer, uint16_t buffer_size);
+void ota_get_progress(uint8_t *status, uint32_t *page_addr, uint32_t *page_offset);
+
+// serializes flash writes of kv storage against OTA programming
+void ota_flash_lock(void);
+void ota_flash_unlock(void);
 
 #endif
@@ -21,6 +21,11 @@ sm_persistent_t sm_persistent =
 #define SECURITY_PERSISTENT_DATA    (&sm_persistent)
 #define PRIVATE_ADDR_MODE           GAP_RANDOM_ADDRESS_OFF
 
+// HCI_Read_RSSI
+#define OPCODE_READ_RSSI            0x1405
+// HCI_LE_Read_PHY
+#define OPCODE_LE_READ_PHY          0x2030
+
 // GATT characteristic handles
 #include "../data/gatt.const"
 
@@ -45,7 +50,7 @@ const static uint8_t profile_data[] = {
 
 #include "../data/gatt.const"
 
-extern void at_on_adv_set_terminated(void);
+extern void at_on_adv_set_terminated(uint8_t adv_handle, uint8_t status);
 extern void at_on_adv_report(const le_ext_adv_report_t *report);
 extern int at_att_write_callback(hci_con_handle_t connection_handle, uint16_t att_handle, uint16_t transaction_mode,
                               uint16_t offset, const uint8_t *buffer, uint16_t buffer_size);
@@ -53,7 +58,21 @@ extern uint16_t at_att_read_callback(hci_con_handle_t connection_handle, uint16_
                                   uint8_t * buffer, uint16_t buffer_size);
 extern void at_on_connection_complete(const le_meta_event_enh_create_conn_complete_t *complete);
 extern void at_on_disconnect(const event_disconn_complete_t *complete);
+extern void at_on_phy_update(const le_meta_phy_update_complete_t *complete);
+extern void at_on_per_sync_established(const le_meta_event_periodic_adv_sync_established_t *established);
+extern void at_on_per_adv_report(const le_meta_event_periodic_adv_report_t *report);
+extern void at_on_per_sync_lost(uint16_t handle);
 extern void at_on_sm_state_changed(uint8_t reason);
+extern void at_on_can_send_now(void);
+extern void at_on_read_rssi(uint8_t status, uint16_t handle, int8_t rssi);
+extern void at_on_read_phy(uint8_t status, uint16_t handle, uint8_t tx_phy, uint8_t rx_phy);
+extern const uint8_t *at_get_gatt_db(void);
+
+const uint8_t *get_static_profile(uint16_t *size)
+{
+    *size = sizeof(profile_data);
+    return profile_data;
+}
 
 static uint16_t att_read_callback(hci_con_handle_t connection_handle, uint16_t att_handle, uint16_t offset,
                                   uint8_t * buffer, uint16_t buffer_size)
@@ -63,6 +82,7 @@ static uint16_t att_read_callback(hci_con_handle_t connection_handle, uint16_t a
     case HANDLE_FOTA_VERSION:
     case HANDLE_FOTA_DATA:
     case HANDLE_FOTA_CONTROL:
+    case HANDLE_FOTA_STATUS_CLIENT_CHAR_CONFIG:
         return ota_read_callback(att_handle, offset, buffer, buffer_size);
     default:
 
@@ -77,7 +97,8 @@ static int att_write_callback(hci_con_handle_t connection_handle, uint16_t att_h
     {
     case HANDLE_FOTA_DATA:
     case HANDLE_FOTA_CONTROL:
-        return ota_write_callback(att_handle, transaction_mode, offset, buffer, buffer_size);
+    case HANDLE_FOTA_STATUS_CLIENT_CHAR_CONFIG:
+        return ota_write_callback(connection_handle, att_handle, transaction_mode, offset, buffer, buffer_size);
     default:
         return at_att_write_callback(connection_handle, att_handle, transaction_mode, offset, buffer, buffer_size);
     }
@@ -117,8 +138,20 @@ static void user_packet_handler(uint8_t packet_type, uint16_t channel, const uin
         switch (hci_event_command_complete_get_command_opcode(packet))
         {
         // add your code to check command complete response
-        // case :
-        //     break;
+        case OPCODE_READ_RSSI:
+            {
+                // status, handle, rssi
+                const uint8_t *param = hci_event_command_complete_get_return_parameters(packet);
+                at_on_read_rssi(param[0], param[1] | (param[2] << 8), (int8_t)param[3]);
+            }
+            break;
+        case OPCODE_LE_READ_PHY:
+            {
+                // status, handle, tx_phy, rx_phy
+                const uint8_t *param = hci_event_command_complete_get_return_parameters(packet);
+                at_on_read_phy(param[0], param[1] | (param[2] << 8), param[3], param[4]);
+            }
+            break;
         default:
             break;
         }
@@ -133,10 +166,9 @@ static void user_packet_handler(uint8_t packet_type, uint16_t channel, const uin
                     decode_hci_le_meta_event(packet, le_meta_event_enh_create_conn_complete_t);
                 if ((complete->role == HCI_ROLE_SLAVE) && (complete->status == 0))
                 {
-                    att_set_db(complete->handle, profile_data);
+                    const uint8_t *db = at_get_gatt_db();
+                    att_set_db(complete->handle, db ? db : profile_data);
                 }
-                if (complete->status == 0)
-                    gap_set_phy(complete->handle, 0, PHY_2M_BIT, PHY_2M_BIT, HOST_PREFER_S2_CODING);
                 at_on_connection_complete(complete);
             }
             break;
@@ -146,8 +178,24 @@ static void user_packet_handler(uint8_t packet_type, uint16_t channel, const uin
                 at_on_adv_report(report);
             }
             break;
+        case HCI_SUBEVENT_LE_PERIODIC_ADVERTISING_SYNC_ESTABLISHED:
+            at_on_per_sync_established(decode_hci_le_meta_event(packet, le_meta_event_periodic_adv_sync_established_t));
+            break;
+        case HCI_SUBEVENT_LE_PERIODIC_ADVERTISING_REPORT:
+            at_on_per_adv_report(decode_hci_le_meta_event(packet, le_meta_event_periodic_adv_report_t));
+            break;
+        case HCI_SUBEVENT_LE_PERIODIC_ADVERTISING_SYNC_LOST:
+            at_on_per_sync_lost(decode_hci_le_meta_event(packet, le_meta_event_sync_lost_t)->handle);
+            break;
+        case HCI_SUBEVENT_LE_PHY_UPDATE_COMPLETE:
+            at_on_phy_update(decode_hci_le_meta_event(packet, le_meta_phy_update_complete_t));
+            break;
         case HCI_SUBEVENT_LE_ADVERTISING_SET_TERMINATED:
-            at_on_adv_set_terminated();
+            {
+                const le_meta_adv_set_terminate_t *terminated =
+                    decode_hci_le_meta_event(packet, le_meta_adv_set_terminate_t);
+                at_on_adv_set_terminated(terminated->adv_handle, terminated->status);
+            }
             break;
         default:
             break;
@@ -160,7 +208,8 @@ static void user_packet_handler(uint8_t packet_type, uint16_t channel, const uin
         break;
 
     case ATT_EVENT_CAN_SEND_NOW:
-        // add your code
+        ota_on_can_send_now();
+        at_on_can_send_now();
         break;
 
     case BTSTACK_EVENT_USER_MSG:
@@ -205,6 +254,7 @@ uint32_t setup_profile(void *data, void *user_data)
     sm_config(0, IO_CAPABILITY_NO_INPUT_NO_OUTPUT, 0, SECURITY_PERSISTENT_DATA);
     sm_add_event_handler(&sm_event_callback_registration);
     att_server_init(att_read_callback, att_write_callback);
+    ota_init();
     hci_event_callback_registration.callback = &user_packet_handler;
     hci_add_event_handler(&hci_event_callback_registration);
     att_server_register_packet_handler(&user_packet_handler);
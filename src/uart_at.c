@@ -13,6 +13,10 @@
 #include "gatt_client_util.h"
 #include "port_gen_os_driver.h"
 #include "kv_storage.h"
+#include "rom_tools.h"
+#include "ota_service.h"
+#include "FreeRTOS.h"
+#include "task.h"
 
 #define INVALID_HANDLE              0xffff
 
@@ -35,11 +39,16 @@
 typedef void (*f_cmd_handle_set)(int argc, const char *argv[]);
 typedef void (*f_cmd_handle_get)(void);
 
-#define MAX_ARG_C  10
+#define MAX_ARG_C  16
+
+#define MAX_READ_MULTI_HANDLES  (MAX_ARG_C - 1)
 
 enum
 {
     KV_KEY_UART = KV_USER_KEY_START,
+    KV_KEY_GATT_DB,
+    KV_KEY_CONFIG,
+    KV_KEY_ADV_SET_DATA,        // first of the keys of saved data of advertising sets
 };
 
 extern sm_persistent_t sm_persistent;
@@ -57,25 +66,199 @@ typedef struct notification_handler
 struct uart_settings
 {
     uint32_t baud;
+    uint8_t flow_control;
 };
 
 const struct uart_settings def_uart_settings =
 {
     .baud = 115200,
+    .flow_control = 0,
 };
 
-struct write_char_info
+// after AT+UART switches baud rate, the host must send a command at the new
+// rate within this time (in 625us), otherwise the old rate is restored.
+#ifndef UART_VERIFY_TIMEOUT
+#define UART_VERIFY_TIMEOUT         (2 * 1600)
+#endif
+
+struct gatts_value_info
 {
     uint16_t value_handle;
     const uint8_t *data;
 };
 
-struct gatts_value_info
+#ifndef MAX_LONG_VALUE_SIZE
+#define MAX_LONG_VALUE_SIZE         512
+#endif
+
+#if (MAX_LONG_VALUE_SIZE > 512)
+#error  ATT value is 512 bytes at most!
+#endif
+
+// buffer for values longer than one ATT PDU
+struct long_value
 {
     uint16_t value_handle;
-    const uint8_t *data;
+    uint16_t len;
+    uint8_t *data;
+};
+
+#ifndef MAX_GATTS_CACHE_NUM
+#define MAX_GATTS_CACHE_NUM         8
+#endif
+
+#ifndef MAX_RUNTIME_DB_SIZE
+#define MAX_RUNTIME_DB_SIZE         1024
+#endif
+
+#ifndef MAX_WRNR_QUEUE_SIZE
+#define MAX_WRNR_QUEUE_SIZE         2048
+#endif
+
+// GATT client operations queued on each connection
+#ifndef MAX_GATTC_QUEUE_DEPTH
+#define MAX_GATTC_QUEUE_DEPTH       8
+#endif
+
+// round trips measured by one AT+BLEPING
+#ifndef MAX_PING_COUNT
+#define MAX_PING_COUNT              100
+#endif
+
+// range of AT+BLELQ period in ms
+#define MIN_LQ_PERIOD               100
+#define MAX_LQ_PERIOD               600000
+
+// largest packet generated by AT+BLETPUT
+#ifndef MAX_TPUT_PACKET_SIZE
+#define MAX_TPUT_PACKET_SIZE        244
+#endif
+
+// advertising sets, including set 0 (AT+BLEADVxxx)
+#ifndef MAX_ADV_SET_NUM
+#define MAX_ADV_SET_NUM             2
+#endif
+
+#define MAX_EXT_ADV_DATA_LEN        1650
+
+// devices kept for AT+BLESCANLIST
+#ifndef MAX_SCAN_TABLE_SIZE
+#define MAX_SCAN_TABLE_SIZE         32
+#endif
+
+#if (MAX_SCAN_TABLE_SIZE > 254)
+#error  MAX_SCAN_TABLE_SIZE: 254 at most!
+#endif
+
+// advertising/scan response data kept for each device (longer data is truncated)
+#ifndef MAX_SCAN_DATA_LEN
+#define MAX_SCAN_DATA_LEN           31
+#endif
+
+// periodic advertising trains synchronized at the same time
+#ifndef MAX_PER_SYNC_NUM
+#define MAX_PER_SYNC_NUM            4
+#endif
+
+typedef struct wrnr_chunk
+{
+    struct wrnr_chunk *next;
+    uint16_t value_handle;
+    uint16_t len;
+    uint8_t data[0];
+} wrnr_chunk_t;
+
+struct wrnr_info
+{
+    wrnr_chunk_t *first;
+    wrnr_chunk_t *last;
+    uint16_t sent;          // bytes of `first` that have been sent
+    uint16_t queued;        // bytes in queue
+    uint8_t waiting;        // waiting for GATT_EVENT_CAN_WRITE_WITHOUT_RESPONSE
+    int16_t tag;            // tag of the latest AT+BLEGATTCWRNR
+    uint32_t total;
+    uint64_t start_time;
+};
+
+enum
+{
+    TPUT_NONE,
+    TPUT_NOTIFY,            // generator, as server
+    TPUT_WRITE,             // generator, as client (write without response)
+    TPUT_SINK,
+};
+
+// throughput test, as generator or sink
+struct tput_info
+{
+    uint8_t mode;
+    uint8_t waiting;
+    int16_t tag;
+    uint16_t value_handle;
+    uint16_t size;          // bytes per packet
+    uint32_t target;        // bytes to send/receive (sink: 0 for unlimited)
+    uint32_t bytes;
+    uint32_t packets;
+    uint32_t stalls;        // generator: out of buffers; sink: out-of-sequence packets
+    uint32_t next_seq;      // sink: sequence number expected next
+    uint64_t start_time;
+};
+
+// status of +BLETPUT when stopped by AT+BLETPUT=<conn_index>,<handle>,0
+#define TPUT_ABORTED    -1
+
+enum
+{
+    GATTC_OP_DISCOVER,
+    GATTC_OP_READ,
+    GATTC_OP_READ_LONG,
+    GATTC_OP_READ_MULTI,
+    GATTC_OP_WRITE,
+    GATTC_OP_WRITE_LONG,
+    GATTC_OP_SUB,
+    GATTC_OP_PING,
+};
+
+// GATT client allows one procedure at a time on a connection, so
+// operations are queued and started one after another.
+typedef struct gattc_op
+{
+    struct gattc_op *next;
+    uint8_t type;
+    int16_t tag;
+    uint16_t value_handle;
+    uint16_t desc_handle;   // GATTC_OP_SUB
+    uint16_t len;
+    uint8_t data[0];
+} gattc_op_t;
+
+// link quality counters for AT+BLELQ
+struct lq_info
+{
+    int8_t rssi;
+    uint8_t waiting;        // waiting for the result of gap_read_rssi
+    uint32_t errors;        // GATT client procedures failed in this period
+};
+
+// AT+BLEPING in progress
+struct ping_info
+{
+    uint16_t count;
+    uint16_t done;
+    uint64_t sent_time;
+    uint32_t *samples;      // round trip time of each request in us
+};
+
+struct gattc_queue
+{
+    gattc_op_t *first;      // `first` is in progress when `busy`
+    gattc_op_t *last;
+    uint8_t num;
+    uint8_t busy;
 };
 
+static uint8_t gattc_queue_depth = MAX_GATTC_QUEUE_DEPTH;
+
 typedef struct
 {
     hci_con_handle_t handle;
@@ -85,8 +268,22 @@ typedef struct
     notification_handler_t *first_handler;
     struct gatt_client_discoverer *discoverer;
 
-    struct write_char_info write_char_info;
     struct gatts_value_info gatts_value_info;
+    uint16_t read_multi_handles[MAX_READ_MULTI_HANDLES];
+    struct wrnr_info wrnr;
+    struct gattc_queue gattc;
+    struct ping_info ping;
+    struct lq_info lq;
+    struct tput_info tput_tx;
+    struct tput_info tput_rx;
+
+    struct long_value client_long;      // long read/write as a client
+    struct long_value prepared_write;   // queued writes from client
+    struct long_value read_response;    // value given by AT+BLEGATTSRD, for Read Blob
+
+    // PHY preference, requested when connected (tx_phys == 0: no request)
+    uint8_t tx_phys, rx_phys, phy_opt;
+    uint8_t tx_phy, rx_phy;             // current PHY
 } conn_info_t;
 
 // master role comes first; then slave role.
@@ -101,6 +298,8 @@ uint8_t handle_2_id[26] = {0};
 int initiating_index = -1;
 int initiating_timeout = 30;
 static uint8_t sec_auth_req = 0;
+static uint8_t sec_enable = 0;
+static uint8_t sec_io_cap = IO_CAPABILITY_NO_INPUT_NO_OUTPUT;
 
 typedef struct
 {
@@ -130,6 +329,69 @@ void *at_alloc(size_t size)
     return r;
 }
 
+// Command tag: `AT#<tag>+...` gets every response and completion of the
+// command prefixed with `#<tag>`, e.g. `#5OK`, `#5+BLEGATTCRD:...`.
+#define NO_TAG          -1
+#define MAX_TAG         9999
+
+static TaskHandle_t at_task = NULL;     // recorded by at_task_entry
+static int16_t cmd_tag = NO_TAG;        // command being handled in AT task
+static int16_t stack_tag = NO_TAG;      // completion being reported in stack context
+
+// the stack task may preempt the AT task at any time, so tell them apart
+// by the running task.
+static int16_t current_tag(void)
+{
+    return xTaskGetCurrentTaskHandle() == at_task ? cmd_tag : stack_tag;
+}
+
+typedef void (*f_stack_runnable)(void *user_data, uint16_t value);
+
+typedef struct
+{
+    f_stack_runnable fn;
+    void *user_data;
+    uint16_t value;
+    int16_t tag;
+} tagged_runnable_t;
+
+static void run_tagged(void *user_data, uint16_t _)
+{
+    tagged_runnable_t *r = (tagged_runnable_t *)user_data;
+    stack_tag = r->tag;
+    r->fn(r->user_data, r->value);
+    stack_tag = NO_TAG;
+    free(r);
+}
+
+// like btstack_push_user_runnable, while responses in `fn` carry the tag of
+// the command being handled.
+static void at_push_runnable(f_stack_runnable fn, void *user_data, uint16_t value)
+{
+    if (cmd_tag == NO_TAG)
+    {
+        btstack_push_user_runnable(fn, user_data, value);
+        return;
+    }
+
+    tagged_runnable_t *r = (tagged_runnable_t *)at_alloc(sizeof(tagged_runnable_t));
+    r->fn = fn;
+    r->user_data = user_data;
+    r->value = value;
+    r->tag = cmd_tag;
+    btstack_push_user_runnable(run_tagged, r, 0);
+}
+
+// GATT client completions of a link are reported with the tag of the
+// operation in progress.
+static void gattc_report_begin(uint16_t handle)
+{
+    const gattc_op_t *op = conn_infos[get_id_of_handle(handle)].gattc.first;
+    stack_tag = op ? op->tag : NO_TAG;
+}
+
+#define gattc_report_end()      do { stack_tag = NO_TAG; } while (0)
+
 void at_tx_ok(void)
 {
     const static char ok[] = "OK\n";
@@ -183,7 +445,7 @@ static void set_ble_addr(int argc, const char *argv[])
     if (parse_addr(argv[1], sm_persistent.identity_addr) != 0)
         goto error;
 
-    btstack_push_user_runnable(update_addr, NULL, 0);
+    at_push_runnable(update_addr, NULL, 0);
 
     at_tx_ok();
     return;
@@ -193,20 +455,69 @@ error:
     return;
 }
 
+static volatile uint32_t uart_old_baud = 0;     // 0: no pending baud change
+
+static void get_uart(void);
+
+static void uart_verify_timeout(void)
+{
+    extern void update_baud(uint32_t baud);
+
+    if (0 == uart_old_baud) return;
+
+    update_baud(uart_old_baud);
+    uart_old_baud = 0;
+    get_uart();
+}
+
+static void stack_confirm_baud(void *user_data, uint16_t _)
+{
+    extern uint32_t uart_get_baud(void);
+
+    if (0 == uart_old_baud) return;
+
+    platform_set_timer(uart_verify_timeout, 0);
+    uart_old_baud = 0;
+
+    struct uart_settings *p_uart = (struct uart_settings *)kv_get(KV_KEY_UART, NULL);
+    p_uart->baud = uart_get_baud();
+    kv_commit(1);
+}
+
+static void stack_switch_baud(void *user_data, uint16_t _)
+{
+    extern uint32_t uart_get_baud(void);
+    extern void uart_switch_baud(uint32_t baud);
+
+    // acknowledge at the old rate
+    at_tx_ok();
+    uart_old_baud = uart_get_baud();
+    uart_switch_baud((uint32_t)(uintptr_t)user_data);
+    platform_set_timer(uart_verify_timeout, UART_VERIFY_TIMEOUT);
+}
+
+static void get_uart(void)
+{
+    extern uint32_t uart_get_baud(void);
+    int len = sprintf(buffer, "+UART:%u\n", uart_get_baud());
+    tx_data(buffer, len + 1);
+}
+
 static void set_uart(int argc, const char *argv[])
 {
+    extern uint32_t uart_get_baud(void);
+    extern int uart_baud_supported(uint32_t baud);
+
     if (argc < 1)
         goto error;
 
-    struct uart_settings *p_uart = (struct uart_settings *)kv_get(KV_KEY_UART, NULL);
     uint32_t v = (uint32_t)atoi(argv[0]);
 
-    if (v != p_uart->baud)
-    {
-        p_uart->baud = v;
-        kv_commit(1);
-        platform_reset();
-    }
+    if (uart_old_baud || !uart_baud_supported(v))
+        goto error;
+
+    if (v != uart_get_baud())
+        at_push_runnable(stack_switch_baud, (void *)(uintptr_t)v, 0);
     else
         at_tx_ok();
     return;
@@ -216,6 +527,43 @@ error:
     return;
 }
 
+static void stack_set_flow_control(void *user_data, uint16_t enable)
+{
+    extern void uart_set_flow_control(uint8_t enable);
+
+    struct uart_settings *p_uart = (struct uart_settings *)kv_get(KV_KEY_UART, NULL);
+    p_uart->flow_control = (uint8_t)enable;
+    kv_commit(1);
+
+    // acknowledge before the host side switches
+    at_tx_ok();
+    uart_set_flow_control((uint8_t)enable);
+}
+
+static void get_uart_fc(void)
+{
+    const struct uart_settings *p_uart = (const struct uart_settings *)kv_get(KV_KEY_UART, NULL);
+    int len = sprintf(buffer, "+UARTFC:%d\n", p_uart->flow_control);
+    tx_data(buffer, len + 1);
+}
+
+static void set_uart_fc(int argc, const char *argv[])
+{
+    if (argc < 1)
+        goto error;
+
+    int enable = atoi(argv[0]);
+    if ((enable < 0) || (enable > 1))
+        goto error;
+
+    at_push_runnable(stack_set_flow_control, NULL, (uint16_t)enable);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
 struct
 {
     uint8_t advertising;
@@ -251,8 +599,15 @@ struct
     uint16_t interval;
     uint8_t filter_type;
     bd_addr_t filter_addr;
+
+    // AT+BLESCANPHY: PHYs to scan on, and interval/window of each
+    // (0: scan_interval/scan_window)
+    uint8_t phys;
+    uint16_t interval_1m, window_1m;
+    uint16_t interval_coded, window_coded;
 } scan_param =
 {
+    .phys = PHY_1M_BIT | PHY_CODED_BIT,
     .scan_type = SCAN_PASSIVE,
     .own_addr_type = BD_ADDR_TYPE_LE_RANDOM,
     .filter_policy = SCAN_ACCEPT_ALL_EXCEPT_NOT_DIRECTED,
@@ -356,6 +711,27 @@ static int load_hex_data(const char *s, uint8_t *data)
     return r;
 }
 
+static void tx_hex_value(const char *prefix, const uint8_t *data, int len, const char *suffix)
+{
+    // values may be longer than `buffer`, so build the line on heap
+    int prefix_len = strlen(prefix);
+    int suffix_len = strlen(suffix);
+    char *line = (char *)at_alloc(prefix_len + len * 2 + suffix_len + 1);
+    char *s = line + prefix_len;
+    strcpy(line, prefix);
+    s = append_hex_str(s, data, len);
+    strcpy(s, suffix);
+    tx_data(line, s - line + suffix_len + 1);
+    free(line);
+}
+
+static void free_long_value(struct long_value *v)
+{
+    if (v->data) free(v->data);
+    v->data = NULL;
+    v->len = 0;
+}
+
 static void set_ble_adv_data(int argc, const char *argv[])
 {
     if (argc < 1) goto error;
@@ -423,73 +799,194 @@ static void stack_set_ble_adv_stop(void *a, uint16_t b)
 static void get_ble_adv_start(void)
 {
     adv_param.advertising = 1;
-    btstack_push_user_runnable(stack_set_ble_adv_start, NULL, 0);
+    at_push_runnable(stack_set_ble_adv_start, NULL, 0);
     at_tx_ok();
 }
 
 static void get_ble_adv_stop(void)
 {
     adv_param.advertising = 0;
-    btstack_push_user_runnable(stack_set_ble_adv_stop, NULL, 0);
+    at_push_runnable(stack_set_ble_adv_stop, NULL, 0);
     at_tx_ok();
 }
 
-void at_on_adv_set_terminated(void)
+enum
 {
-    if (adv_param.advertising)
-        gap_set_ext_adv_enable(1, sizeof(adv_sets_en) / sizeof(adv_sets_en[0]), adv_sets_en);
-}
+    ADV_DATA_ADV,
+    ADV_DATA_SCAN_RSP,
+    ADV_DATA_PERIODIC,
+    ADV_DATA_NUM
+};
 
-static void stack_scan(void *a, uint16_t b)
+typedef struct adv_data
 {
-    if (b)
+    uint16_t len;
+    uint8_t data[0];
+} adv_data_t;
+
+// Advertising sets 1 .. MAX_ADV_SET_NUM - 1, managed by AT+BLEADVSETxxx.
+// Set 0 is the one of AT+BLEADVxxx.
+struct adv_set
+{
+    uint8_t advertising;
+    uint8_t configured;
+    uint32_t adv_int_min, adv_int_max;
+    uint16_t adv_type;
+    uint8_t own_addr_type;
+    uint8_t channel_map;
+    uint8_t adv_filter_policy;
+    uint8_t peer_addr_type;
+    bd_addr_t peer_addr;
+    int8_t tx_power;
+    uint8_t primary_phy;
+    uint8_t secondary_phy;
+    uint8_t sid;
+    ext_adv_set_en_t en;
+
+    // periodic advertising
+    uint8_t per_advertising;
+    uint16_t per_int_min, per_int_max;
+    uint16_t per_properties;
+
+    // indexed by ADV_DATA_xxx: `data` is owned by the stack task, and
+    // `pending` holds fragments collected by the AT task (`<append>` = 1)
+    adv_data_t *data[ADV_DATA_NUM];
+    adv_data_t *pending[ADV_DATA_NUM];
+};
+
+static struct adv_set adv_sets[MAX_ADV_SET_NUM] = {0};
+
+void at_on_adv_set_terminated(uint8_t adv_handle, uint8_t status)
+{
+    struct adv_set *set = adv_handle < MAX_ADV_SET_NUM ? adv_sets + adv_handle : NULL;
+
+    if (0 == adv_handle)
     {
-        scan_phy_config_t configs[2] =
-        {
-            {
-                .phy = PHY_1M,
-                .type = scan_param.scan_type,
-                .interval = scan_param.scan_interval,
-                .window = scan_param.scan_window,
-            },
-            {
-                .phy = PHY_CODED,
-                .type = scan_param.scan_type,
-                .interval = scan_param.scan_interval,
-                .window = scan_param.scan_window,
-            }
-        };
-        gap_set_ext_scan_para(BD_ADDR_TYPE_LE_RANDOM, scan_param.filter_policy,
-                              sizeof(configs) / sizeof(configs[0]), configs);
-        gap_set_ext_scan_enable(1, 0, scan_param.interval * 100, 0);
+        if (adv_param.advertising)
+            gap_set_ext_adv_enable(1, sizeof(adv_sets_en) / sizeof(adv_sets_en[0]), adv_sets_en);
+        return;
     }
+
+    if ((NULL == set) || (0 == set->advertising)) return;
+
+    // restarted after a connection is created, and stopped when
+    // duration or max_events is reached
+    if (0 == status)
+        gap_set_ext_adv_enable(1, 1, &set->en);
     else
     {
-        gap_set_ext_scan_enable(0, 0, 0, 0);
+        int len;
+        set->advertising = 0;
+        len = sprintf(buffer, "+BLEADVSETSTOP:%d\n", adv_handle);
+        tx_data(buffer, len + 1);
     }
 }
 
-static void get_ble_scan_param(void)
+static struct adv_set *get_adv_set(const char *arg)
 {
-    sprintf(buffer, "+BLESCANPARAM:%d,%d,%d,%d,%d\n",
-            scan_param.scan_type,
-            scan_param.own_addr_type,
-            scan_param.filter_policy,
-            scan_param.scan_interval,
-            scan_param.scan_window);
-    tx_data(buffer, strlen(buffer) + 1);
+    int id = atoi(arg);
+    if ((id < 1) || (id >= MAX_ADV_SET_NUM))
+        return NULL;
+    return adv_sets + id;
+}
+
+static void stack_adv_set_param(void *user_data, uint16_t id)
+{
+    struct adv_set *set = adv_sets + id;
+    gap_set_ext_adv_para(id,
+                         set->adv_type,
+                         set->adv_int_min, set->adv_int_max,
+                         set->channel_map,
+                         set->own_addr_type,
+                         set->peer_addr_type,
+                         set->peer_addr,
+                         set->adv_filter_policy,
+                         set->tx_power,
+                         set->primary_phy,
+                         0,
+                         set->secondary_phy,
+                         set->sid,
+                         0x00);
+    gap_set_adv_set_random_addr(id, sm_persistent.identity_addr);
+}
+
+static void get_ble_adv_set_param(void)
+{
+    int i;
+    for (i = 1; i < MAX_ADV_SET_NUM; i++)
+    {
+        struct adv_set *set = adv_sets + i;
+        int len;
+        if (0 == set->configured) continue;
+        len = sprintf(buffer, "+BLEADVSETPARAM:%d,%u,%u,%u,%u,%u,%u,%u,", i,
+                      set->adv_int_min, set->adv_int_max,
+                      set->adv_type,
+                      set->own_addr_type,
+                      set->channel_map,
+                      set->adv_filter_policy,
+                      set->peer_addr_type);
+        len = append_bd_addr(buffer + len, set->peer_addr) - buffer;
+        len += sprintf(buffer + len, ",%d,%d,%d,%d,%d\n",
+                       set->tx_power, set->primary_phy, set->secondary_phy, set->sid,
+                       set->advertising);
+        tx_data(buffer, len + 1);
+    }
     at_tx_ok();
 }
 
-static void set_ble_scan_param(int argc, const char *argv[])
+// AT+BLEADVSETPARAM=<set>,<adv_int_min>,<adv_int_max>,<adv_type>,<own_addr_type>,<channel_map>,
+//                   <adv_filter_policy>,<peer_addr_type>,<peer_addr>,<tx_power>
+//                   [,<primary_phy>,<secondary_phy>,<sid>]
+static void set_ble_adv_set_param(int argc, const char *argv[])
 {
-    if (argc < 5) goto error;
+    struct adv_set *set;
+    struct adv_set param;
+
+    if (argc < 10) goto error;
+    set = get_adv_set(argv[0]);
+    if ((NULL == set) || set->advertising) goto error;
+
+    // parsed and checked as a whole, so that an error leaves the set as is
+    param.adv_int_min        = (uint32_t)atoi(argv[1]);
+    param.adv_int_max        = (uint32_t)atoi(argv[2]);
+    param.adv_type           = (uint16_t)atoi(argv[3]);
+    param.own_addr_type      = (uint8_t)atoi(argv[4]);
+    param.channel_map        = (uint8_t)atoi(argv[5]);
+    param.adv_filter_policy  = (uint8_t)atoi(argv[6]);
+    param.peer_addr_type     = (uint8_t)atoi(argv[7]);
+    if (parse_addr(argv[8], param.peer_addr)) goto error;
+    param.tx_power           = (int8_t)atoi(argv[9]);
+    param.primary_phy        = argc >= 11 ? (uint8_t)atoi(argv[10]) : PHY_1M;
+    param.secondary_phy      = argc >= 12 ? (uint8_t)atoi(argv[11]) : PHY_1M;
+    param.sid                = argc >= 13 ? (uint8_t)atoi(argv[12]) : (uint8_t)(set - adv_sets);
+
+    // ranges of HCI_LE_Set_Extended_Advertising_Parameters
+    if (   (param.adv_int_min < 0x20) || (param.adv_int_max > 0xffffff)
+        || (param.adv_int_max < param.adv_int_min)
+        || (param.adv_type > 0x7f) || (param.own_addr_type > 3)
+        || (param.channel_map < 1) || (param.channel_map > 7)
+        || (param.adv_filter_policy > 3) || (param.peer_addr_type > 1)
+        || ((param.primary_phy != PHY_1M) && (param.primary_phy != PHY_CODED))
+        || (param.secondary_phy < PHY_1M) || (param.secondary_phy > PHY_CODED)
+        || (param.sid > 0xf))
+        goto error;
 
-    scan_param.scan_type        = (scan_type_t)atoi(argv[0]);
-    scan_param.own_addr_type    = (bd_addr_type_t)atoi(argv[1]);
-    scan_param.filter_policy    = (scan_filter_policy_t)atoi(argv[2]);
-    scan_param.scan_interval    = (uint16_t)atoi(argv[3]);
-    scan_param.scan_interval    = (uint16_t)atoi(argv[4]);
+    // data of the set is owned by the stack task, copy parameters only
+    set->adv_int_min        = param.adv_int_min;
+    set->adv_int_max        = param.adv_int_max;
+    set->adv_type           = param.adv_type;
+    set->own_addr_type      = param.own_addr_type;
+    set->channel_map        = param.channel_map;
+    set->adv_filter_policy  = param.adv_filter_policy;
+    set->peer_addr_type     = param.peer_addr_type;
+    memcpy(set->peer_addr, param.peer_addr, sizeof(set->peer_addr));
+    set->tx_power           = param.tx_power;
+    set->primary_phy        = param.primary_phy;
+    set->secondary_phy      = param.secondary_phy;
+    set->sid                = param.sid;
+    set->configured = 1;
+
+    at_push_runnable(stack_adv_set_param, NULL, set - adv_sets);
 
     at_tx_ok();
     return;
@@ -499,53 +996,102 @@ error:
     return;
 }
 
-void at_on_adv_report(const le_ext_adv_report_t *report)
+// appends hex string `s` to the pending data of `type`.
+// `*complete` is set to the whole data once `more` is 0, and the caller hands
+// it to the stack task.
+static int load_adv_set_data(struct adv_set *set, int type, const char *s, int more,
+                             adv_data_t **complete)
 {
-    bd_addr_t addr;
-    reverse_bd_addr(report->address, addr);
-    if (scan_param.filter_type == 1)
-    {
-        if (memcmp(addr, scan_param.filter_addr, BD_ADDR_LEN))
-            return;
-    }
+    adv_data_t *pending = set->pending[type];
+    int old_len = pending ? pending->len : 0;
+    int len = strlen(s) / 2 + old_len;
+    adv_data_t *p;
+    if (len > MAX_EXT_ADV_DATA_LEN) return -1;
+
+    p = (adv_data_t *)at_alloc(sizeof(adv_data_t) + len);
+    if (old_len)
+        memcpy(p->data, pending->data, old_len);
+    load_hex_data(s, p->data + old_len);
+    p->len = (uint16_t)len;
+    if (pending) free(pending);
+
+    set->pending[type] = more ? p : NULL;
+    *complete = more ? NULL : p;
+    return 0;
+}
 
-    strcpy(buffer, "+BLESCAN:");
-    char *s = buffer + 9;
-    s = append_bd_addr(s, addr);
+// data can't be fragmented while the set (or the periodic train) is enabled
+#define MAX_EXT_ADV_DATA_LEN_ENABLED    251
+#define MAX_PER_ADV_DATA_LEN_ENABLED    252
 
-    if (report->evt_type & HCI_EXT_ADV_PROP_SCAN_RSP)
-    {
-        s += sprintf(s, ",%d,,", report->rssi);
-        s = append_hex_str(s, report->data, report->data_len);
-        s += sprintf(s, ",%d", report->addr_type);
-    }
-    else
+// hands data of `type` to the stack, which fragments data longer than one
+// HCI command. On success, `d` replaces the old data, which is freed;
+// otherwise the caller still owns `d`. Called in stack context.
+static int install_adv_data(uint8_t id, int type, adv_data_t *d)
+{
+    struct adv_set *set = adv_sets + id;
+    adv_data_t *old = set->data[type];
+    int r;
+
+    switch (type)
     {
-        s += sprintf(s, ",%d,", report->rssi);
-        s = append_hex_str(s, report->data, report->data_len);
-        s += sprintf(s, ",,%d", report->addr_type);
+    case ADV_DATA_ADV:
+        r = (set->advertising && (d->len > MAX_EXT_ADV_DATA_LEN_ENABLED))
+            || gap_set_ext_adv_data(id, d->len, d->data);
+        break;
+    case ADV_DATA_SCAN_RSP:
+        r = (set->advertising && (d->len > MAX_EXT_ADV_DATA_LEN_ENABLED))
+            || gap_set_ext_scan_response_data(id, d->len, d->data);
+        break;
+    default:
+        r = (set->per_advertising && (d->len > MAX_PER_ADV_DATA_LEN_ENABLED))
+            || gap_set_periodic_adv_data(id, d->len, d->data);
+        break;
     }
+    if (r) return -1;
 
-    tx_data(buffer, s - buffer + 1);
+    set->data[type] = d;
+    if (old) free(old);
+    return 0;
 }
 
-static void set_ble_scan(int argc, const char *argv[])
+// value: set id | (ADV_DATA_xxx << 8)
+static void stack_adv_set_data(void *user_data, uint16_t value)
 {
-    if (argc < 1) goto error;
-    uint8_t enable = atoi(argv[0]);
+    adv_data_t *d = (adv_data_t *)user_data;
 
-    if (argc >= 2)
-        scan_param.interval        = atoi(argv[1]);
-    if (argc >= 3)
+    if (install_adv_data(value & 0xff, value >> 8, d))
     {
-        scan_param.filter_type    = (bd_addr_type_t)atoi(argv[2]);
-        if (scan_param.filter_type > 1)
-            goto error;
+        free(d);
+        at_tx_error();
     }
-    if (argc >= 4)
-        parse_addr(argv[3], scan_param.filter_addr);
+    else
+        at_tx_ok();
+}
+
+// AT+BLEADVSETDATA=<set>,<type>,<hex_data>[,<append>]
+// type: 0 for advertising data, 1 for scan response data
+// append: 1 if more fragments follow; data is applied by the last one
+static void set_ble_adv_set_data(int argc, const char *argv[])
+{
+    struct adv_set *set;
+    adv_data_t *complete;
+    int type;
+
+    if (argc < 3) goto error;
+    set = get_adv_set(argv[0]);
+    if (NULL == set) goto error;
+
+    type = atoi(argv[1]) == 0 ? ADV_DATA_ADV : ADV_DATA_SCAN_RSP;
+    if (load_adv_set_data(set, type, argv[2], argc >= 4 ? atoi(argv[3]) : 0, &complete))
+        goto error;
 
-    btstack_push_user_runnable(stack_scan, NULL, enable);
+    if (complete)
+    {
+        // OK or ERROR is reported by the runnable
+        at_push_runnable(stack_adv_set_data, complete, (set - adv_sets) | (type << 8));
+        return;
+    }
 
     at_tx_ok();
     return;
@@ -555,47 +1101,28 @@ error:
     return;
 }
 
-static void stack_gatts_read(void *user_data, uint16_t value_len)
-{
-    conn_info_t *p = (conn_info_t *)user_data;
-    uint8_t r = att_server_deferred_read_response(p->handle,
-                        p->gatts_value_info.value_handle,
-                        p->gatts_value_info.data, value_len);
-    if (0 == r) at_tx_ok(); else at_tx_error();
-}
-
-static void stack_gatts_notify(void *user_data, uint16_t value_len)
-{
-    conn_info_t *p = (conn_info_t *)user_data;
-    uint8_t r = att_server_notify(p->handle,
-                        p->gatts_value_info.value_handle,
-                        p->gatts_value_info.data, value_len);
-    if (0 == r) at_tx_ok(); else at_tx_error();
-}
-
-static void stack_gatts_indicate(void *user_data, uint16_t value_len)
+static void stack_adv_set_enable(void *user_data, uint16_t id)
 {
-    conn_info_t *p = (conn_info_t *)user_data;
-    uint8_t r = att_server_indicate(p->handle,
-                        p->gatts_value_info.value_handle,
-                        p->gatts_value_info.data, value_len);
-    if (0 == r) at_tx_ok(); else at_tx_error();
+    struct adv_set *set = adv_sets + id;
+    gap_set_ext_adv_enable(set->advertising, 1, &set->en);
 }
 
-static void set_ble_gatts_read(int argc, const char *argv[])
+// AT+BLEADVSETSTART=<set>[,<duration>,<max_events>]
+static void set_ble_adv_set_start(int argc, const char *argv[])
 {
-    if (argc != 3) goto error;
-
-    uint8_t id = (uint8_t)atoi(argv[0]);
-    conn_info_t *p = &conn_infos[id];
-    if (p->handle == INVALID_HANDLE) goto error;
+    struct adv_set *set;
 
-    p->gatts_value_info.value_handle = (uint16_t)atoi(argv[1]);
+    if (argc < 1) goto error;
+    set = get_adv_set(argv[0]);
+    if ((NULL == set) || (0 == set->configured)) goto error;
 
-    uint16_t len = (uint16_t)load_hex_data(argv[2], (uint8_t *)argv[2]);
-    p->gatts_value_info.data = (uint8_t *)argv[2];
+    set->en.handle = set - adv_sets;
+    set->en.duration = argc >= 2 ? (uint16_t)atoi(argv[1]) : 0;
+    set->en.max_events = argc >= 3 ? (uint8_t)atoi(argv[2]) : 0;
+    set->advertising = 1;
+    at_push_runnable(stack_adv_set_enable, NULL, set->en.handle);
 
-    btstack_push_user_runnable(stack_gatts_read, p, len);
+    at_tx_ok();
     return;
 
 error:
@@ -603,20 +1130,19 @@ error:
     return;
 }
 
-static void set_ble_gatts_write(int argc, const char *argv[])
+// AT+BLEADVSETSTOP=<set>
+static void set_ble_adv_set_stop(int argc, const char *argv[])
 {
-    if (argc != 4) goto error;
+    struct adv_set *set;
 
-    uint8_t id = (uint8_t)atoi(argv[0]);
-    conn_info_t *p = &conn_infos[id];
-    if (p->handle == INVALID_HANDLE) goto error;
+    if (argc < 1) goto error;
+    set = get_adv_set(argv[0]);
+    if (NULL == set) goto error;
 
-    p->gatts_value_info.value_handle = (uint16_t)atoi(argv[1]);
-    uint8_t mode = (uint8_t)atoi(argv[2]);
-    uint16_t len = (uint16_t)load_hex_data(argv[3], (uint8_t *)argv[3]);
-    p->gatts_value_info.data = (uint8_t *)argv[3];
+    set->advertising = 0;
+    at_push_runnable(stack_adv_set_enable, NULL, set - adv_sets);
 
-    btstack_push_user_runnable(mode == 0 ? stack_gatts_notify : stack_gatts_indicate, p, len);
+    at_tx_ok();
     return;
 
 error:
@@ -624,83 +1150,75 @@ error:
     return;
 }
 
-static void get_ble_conn(void)
+// Periodic advertising runs on an extended advertising set, which must be
+// non-connectable and non-scannable, and be started by AT+BLEADVSETSTART.
+static void stack_per_adv_param(void *user_data, uint16_t id)
+{
+    struct adv_set *set = adv_sets + id;
+    gap_set_periodic_adv_para(id, set->per_int_min, set->per_int_max,
+                              (periodic_adv_properties_t)set->per_properties);
+}
+
+static void get_ble_per_adv_param(void)
 {
     int i;
-    for (i = 0; i < TOTAL_CONN_NUM; i++)
+    for (i = 1; i < MAX_ADV_SET_NUM; i++)
     {
-        conn_info_t *p = conn_infos + i;
-        if (p->handle == INVALID_HANDLE) continue;
-        char *s = buffer + sprintf(buffer, "+BLECONN:%d,", i);
-        s = append_bd_addr(s, p->peer_addr);
-        strcpy(s, "\n");
-        s++;
-        tx_data(buffer, s - buffer + 1);
+        struct adv_set *set = adv_sets + i;
+        int len;
+        if (0 == set->per_int_min) continue;
+        len = sprintf(buffer, "+BLEPERADVPARAM:%d,%d,%d,%d,%d\n", i,
+                      set->per_int_min, set->per_int_max, set->per_properties,
+                      set->per_advertising);
+        tx_data(buffer, len + 1);
     }
     at_tx_ok();
 }
 
-static void stack_cancel_create_conn(void *data, uint16_t index)
+// AT+BLEPERADVPARAM=<set>,<interval_min>,<interval_max>[,<properties>]
+static void set_ble_per_adv_param(int argc, const char *argv[])
 {
-    gap_create_connection_cancel();
-}
+    struct adv_set *set;
 
-static void initiate_timeout(void)
-{
-    btstack_push_user_runnable(stack_cancel_create_conn, NULL, 0);
-}
+    if (argc < 3) goto error;
+    set = get_adv_set(argv[0]);
+    if ((NULL == set) || set->per_advertising) goto error;
 
-static void stack_initiate(void *data, uint16_t index)
-{
-    conn_info_t *p = conn_infos + index;
-    initiating_phy_config_t phy_configs[] =
-    {
-        {
-            .phy = PHY_1M,
-            .conn_param =
-            {
-                .scan_int = 150,
-                .scan_win = 100,
-                .interval_min = p->min_interval,
-                .interval_max = p->max_interval,
-                .latency = p->latency,
-                .supervision_timeout = p->timeout,
-                .min_ce_len = 7,
-                .max_ce_len = 7
-            }
-        }
-    };
+    set->per_int_min = (uint16_t)atoi(argv[1]);
+    set->per_int_max = (uint16_t)atoi(argv[2]);
+    set->per_properties = argc >= 4 ? (uint16_t)atoi(argv[3]) : 0;
+    if ((set->per_int_min < 6) || (set->per_int_max < set->per_int_min)) goto error;
 
-    if (gap_ext_create_connection(
-                INITIATING_ADVERTISER_FROM_PARAM,
-                BD_ADDR_TYPE_LE_RANDOM,
-                p->peer_addr_type,
-                p->peer_addr,
-                sizeof(phy_configs) / sizeof(phy_configs[0]),
-                phy_configs) == 0)
-    {
-        initiating_index = index;
-        platform_set_timer(initiate_timeout, initiating_timeout * 1600);
-    }
+    at_push_runnable(stack_per_adv_param, NULL, set - adv_sets);
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
 }
 
-static void set_ble_conn(int argc, const char *argv[])
+// AT+BLEPERADVDATA=<set>,<hex_data>[,<append>]
+static void set_ble_per_adv_data(int argc, const char *argv[])
 {
-    if (initiating_index >= 0) goto error;
+    struct adv_set *set;
+    adv_data_t *complete;
 
     if (argc < 2) goto error;
+    set = get_adv_set(argv[0]);
+    if (NULL == set) goto error;
 
-    int id = atoi(argv[0]);
-    if (id > MAX_CONN_AS_MASTER) goto error;
-    conn_info_t *p = conn_infos + id;
-    parse_addr(argv[1], p->peer_addr);
-
-    if (argc >= 3)
-        p->peer_addr_type = (bd_addr_type_t)atoi(argv[2]);
-    if (argc >= 4)
-        initiating_timeout = atoi(argv[3]);
+    if (load_adv_set_data(set, ADV_DATA_PERIODIC, argv[1], argc >= 3 ? atoi(argv[2]) : 0,
+                          &complete))
+        goto error;
 
-    btstack_push_user_runnable(stack_initiate, NULL, (uint16_t)id);
+    if (complete)
+    {
+        // OK or ERROR is reported by the runnable
+        at_push_runnable(stack_adv_set_data, complete, (set - adv_sets) | (ADV_DATA_PERIODIC << 8));
+        return;
+    }
 
     at_tx_ok();
     return;
@@ -710,20 +1228,22 @@ error:
     return;
 }
 
-static void stack_disconn(void *data, uint16_t index)
+static void stack_per_adv_enable(void *user_data, uint16_t id)
 {
-    gap_disconnect(index);
+    gap_set_periodic_adv_enable(adv_sets[id].per_advertising, id);
 }
 
-static void set_ble_disconn(int argc, const char *argv[])
+// AT+BLEPERADVSTART=<set>
+static void set_ble_per_adv_start(int argc, const char *argv[])
 {
-    if (argc < 1) goto error;
+    struct adv_set *set;
 
-    int id = atoi(argv[0]);
-    conn_info_t *p = conn_infos + id;
-    if (p->handle == INVALID_HANDLE) goto error;
+    if (argc < 1) goto error;
+    set = get_adv_set(argv[0]);
+    if ((NULL == set) || (0 == set->per_int_min)) goto error;
 
-    btstack_push_user_runnable(stack_disconn, NULL, get_handle_of_id(id));
+    set->per_advertising = 1;
+    at_push_runnable(stack_per_adv_enable, NULL, set - adv_sets);
 
     at_tx_ok();
     return;
@@ -733,53 +1253,79 @@ error:
     return;
 }
 
-conn_info_t *get_conn_by_addr(bd_addr_type_t type, const uint8_t *addr)
+// AT+BLEPERADVSTOP=<set>
+static void set_ble_per_adv_stop(int argc, const char *argv[])
 {
-    int i;
-    for (i = 0; i < MAX_CONN_AS_MASTER; i++)
-    {
-        if ((conn_infos[i].peer_addr_type == type)
-            && (memcmp(conn_infos[i].peer_addr, addr, sizeof(conn_infos[i].peer_addr)) == 0))
-            return conn_infos + i;
-    }
-    return NULL;
+    struct adv_set *set;
+
+    if (argc < 1) goto error;
+    set = get_adv_set(argv[0]);
+    if (NULL == set) goto error;
+
+    set->per_advertising = 0;
+    at_push_runnable(stack_per_adv_enable, NULL, set - adv_sets);
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
 }
 
-static void get_ble_conn_param(void)
+static void stack_scan(void *a, uint16_t b)
 {
-    int i;
-    for (i = 0; i < TOTAL_CONN_NUM; i++)
+    if (b)
     {
-        conn_info_t *p = conn_infos + i;
-        if (p->handle == INVALID_HANDLE) continue;
-        int len = sprintf(buffer, "+BLECONNPARAM:%d,%d,%d,%d,%d,%d",
-            i, p->min_interval, p->max_interval, p->cur_interval,
-            p->latency, p->timeout);
-        tx_data(buffer, len + 1);
+        scan_phy_config_t configs[2];
+        int num = 0;
+        if (scan_param.phys & PHY_1M_BIT)
+        {
+            configs[num].phy = PHY_1M;
+            configs[num].type = scan_param.scan_type;
+            configs[num].interval = scan_param.interval_1m ? scan_param.interval_1m : scan_param.scan_interval;
+            configs[num].window = scan_param.window_1m ? scan_param.window_1m : scan_param.scan_window;
+            num++;
+        }
+        if (scan_param.phys & PHY_CODED_BIT)
+        {
+            configs[num].phy = PHY_CODED;
+            configs[num].type = scan_param.scan_type;
+            configs[num].interval = scan_param.interval_coded ? scan_param.interval_coded : scan_param.scan_interval;
+            configs[num].window = scan_param.window_coded ? scan_param.window_coded : scan_param.scan_window;
+            num++;
+        }
+        gap_set_ext_scan_para(BD_ADDR_TYPE_LE_RANDOM, scan_param.filter_policy,
+                              num, configs);
+        gap_set_ext_scan_enable(1, 0, scan_param.interval * 100, 0);
+    }
+    else
+    {
+        gap_set_ext_scan_enable(0, 0, 0, 0);
     }
 }
 
-static void stack_update_conn(void *data, uint16_t index)
+static void get_ble_scan_param(void)
 {
-    conn_info_t *p = conn_infos + index;
-    gap_update_connection_parameters(p->handle,
-        p->min_interval, p->max_interval, p->latency, p->timeout, 7, 7);
+    sprintf(buffer, "+BLESCANPARAM:%d,%d,%d,%d,%d\n",
+            scan_param.scan_type,
+            scan_param.own_addr_type,
+            scan_param.filter_policy,
+            scan_param.scan_interval,
+            scan_param.scan_window);
+    tx_data(buffer, strlen(buffer) + 1);
+    at_tx_ok();
 }
 
-static void set_ble_conn_param(int argc, const char *argv[])
+static void set_ble_scan_param(int argc, const char *argv[])
 {
     if (argc < 5) goto error;
 
-    int id = atoi(argv[0]);
-    conn_info_t *p = conn_infos + id;
-    if (p->handle == INVALID_HANDLE) goto error;
-
-    p->min_interval = (uint16_t)atoi(argv[1]);
-    p->max_interval = (uint16_t)atoi(argv[2]);
-    p->latency      = (uint16_t)atoi(argv[3]);
-    p->timeout      = (uint16_t)atoi(argv[4]);
-
-    btstack_push_user_runnable(stack_update_conn, NULL, get_handle_of_id(id));
+    scan_param.scan_type        = (scan_type_t)atoi(argv[0]);
+    scan_param.own_addr_type    = (bd_addr_type_t)atoi(argv[1]);
+    scan_param.filter_policy    = (scan_filter_policy_t)atoi(argv[2]);
+    scan_param.scan_interval    = (uint16_t)atoi(argv[3]);
+    scan_param.scan_interval    = (uint16_t)atoi(argv[4]);
 
     at_tx_ok();
     return;
@@ -789,84 +1335,2509 @@ error:
     return;
 }
 
-static int print_uuid(char *s, const uint8_t *uuid)
+static void get_ble_scan_phy(void)
 {
-    if (uuid_has_bluetooth_prefix(uuid))
-    {
-        return sprintf(s, "%04x", (uuid[2] << 8) | uuid[3]);
-    }
-    else
-        return sprintf(s, "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
-                        uuid[0], uuid[1], uuid[2], uuid[3],
-                        uuid[4], uuid[5], uuid[6], uuid[7], uuid[8], uuid[9],
-                        uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+    int len = sprintf(buffer, "+BLESCANPHY:%d,%d,%d,%d,%d\n",
+                      scan_param.phys,
+                      scan_param.interval_1m, scan_param.window_1m,
+                      scan_param.interval_coded, scan_param.window_coded);
+    tx_data(buffer, len + 1);
+    at_tx_ok();
 }
 
-static void gatt_client_dump_profile(service_node_t *first, void *user_data, int err_code)
+// AT+BLESCANPHY=<phys>[,<interval_1m>,<window_1m>[,<interval_coded>,<window_coded>]]
+static void set_ble_scan_phy(int argc, const char *argv[])
 {
-    service_node_t *s = first;
-    conn_info_t *p = (conn_info_t *)user_data;
-    int id = p - conn_infos;
-
-    while (s)
-    {
-        char_node_t *c = s->chars;
-        char *str = buffer + sprintf(buffer, "+BLEGATTCPRIMSRV:%d,%d,%d,",
-            id, s->service.start_group_handle, s->service.end_group_handle);
-        str += print_uuid(str, s->service.uuid128);
-        strcpy(str, "\n");
-        tx_data(buffer, str - buffer + 2);
+    if (argc < 1) goto error;
 
-        while (c)
-        {
-            str = buffer + sprintf(buffer, "+BLEGATTCCHAR:%d,%d,%d,%d,%d,",
-                id, c->chara.start_handle, c->chara.end_handle, c->chara.value_handle,
-                c->chara.properties);
-            str += print_uuid(str, c->chara.uuid128);
-            strcpy(str, "\n");
-            tx_data(buffer, str - buffer + 2);
+    uint8_t phys = (uint8_t)atoi(argv[0]);
+    uint16_t interval_1m    = argc >= 3 ? (uint16_t)atoi(argv[1]) : 0;
+    uint16_t window_1m      = argc >= 3 ? (uint16_t)atoi(argv[2]) : 0;
+    uint16_t interval_coded = argc >= 5 ? (uint16_t)atoi(argv[3]) : 0;
+    uint16_t window_coded   = argc >= 5 ? (uint16_t)atoi(argv[4]) : 0;
 
-            desc_node_t *d = c->descs;
-            while (d)
-            {
-                str = buffer + sprintf(buffer, "+BLEGATTCDESC:%d,%d,",
-                    id, d->desc.handle);
-                str += print_uuid(str, d->desc.uuid128);
-                strcpy(str, "\n");
-                tx_data(buffer, str - buffer + 2);
+    // checked as a whole, so that an error leaves the preference as is
+    if (   (0 == phys) || (phys & ~(PHY_1M_BIT | PHY_CODED_BIT))
+        || (window_1m > interval_1m) || (window_coded > interval_coded))
+        goto error;
 
-                d = d->next;
-            }
-            c = c->next;
-        }
-        s = s->next;
-    }
+    scan_param.phys           = phys;
+    scan_param.interval_1m    = interval_1m;
+    scan_param.window_1m      = window_1m;
+    scan_param.interval_coded = interval_coded;
+    scan_param.window_coded   = window_coded;
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static uint32_t hash_data(const uint8_t *data, int len)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    while (len--)
+        h = (h ^ *data++) * 16777619u;
+    return h;
+}
+
+// Devices seen while scanning, so that hosts can poll them with
+// AT+BLESCANLIST. Entries are found by address hash, and the least
+// recently seen one is replaced when the table is full.
+#define SCAN_NIL                0xff
+#define SCAN_HASH_SIZE          (MAX_SCAN_TABLE_SIZE * 2)
+
+typedef struct
+{
+    bd_addr_t addr;
+    uint8_t addr_type;
+    int8_t rssi;
+    uint8_t hash_next;                  // next entry in the same bucket
+    uint8_t lru_prev, lru_next;         // towards less/more recently seen
+    uint8_t adv_len, rsp_len;
+    uint8_t adv_data[MAX_SCAN_DATA_LEN];
+    uint8_t rsp_data[MAX_SCAN_DATA_LEN];
+    uint32_t first_seen, last_seen;     // ms
+    uint32_t count;
+} scan_entry_t;
+
+static scan_entry_t scan_table[MAX_SCAN_TABLE_SIZE];
+static uint8_t scan_buckets[SCAN_HASH_SIZE];
+static uint8_t scan_lru_oldest = SCAN_NIL;
+static uint8_t scan_lru_newest = SCAN_NIL;
+static uint8_t scan_used = 0;
+
+static uint32_t now_ms(void)
+{
+    return (uint32_t)(platform_get_us_time() / 1000);
+}
+
+static uint8_t *scan_bucket(const bd_addr_t addr, uint8_t addr_type)
+{
+    return scan_buckets + (hash_data(addr, BD_ADDR_LEN) ^ addr_type) % SCAN_HASH_SIZE;
+}
+
+static void scan_lru_remove(uint8_t i)
+{
+    scan_entry_t *e = scan_table + i;
+    if (e->lru_prev != SCAN_NIL) scan_table[e->lru_prev].lru_next = e->lru_next; else scan_lru_oldest = e->lru_next;
+    if (e->lru_next != SCAN_NIL) scan_table[e->lru_next].lru_prev = e->lru_prev; else scan_lru_newest = e->lru_prev;
+}
+
+static void scan_lru_append(uint8_t i)
+{
+    scan_entry_t *e = scan_table + i;
+    e->lru_prev = scan_lru_newest;
+    e->lru_next = SCAN_NIL;
+    if (scan_lru_newest != SCAN_NIL) scan_table[scan_lru_newest].lru_next = i; else scan_lru_oldest = i;
+    scan_lru_newest = i;
+}
+
+static void scan_hash_remove(uint8_t i)
+{
+    scan_entry_t *e = scan_table + i;
+    uint8_t *link = scan_bucket(e->addr, e->addr_type);
+    while (*link != i)
+        link = &scan_table[*link].hash_next;
+    *link = e->hash_next;
+}
+
+static scan_entry_t *scan_table_get(const bd_addr_t addr, uint8_t addr_type)
+{
+    uint8_t *bucket = scan_bucket(addr, addr_type);
+    uint8_t i = *bucket;
+    scan_entry_t *e;
+
+    while (i != SCAN_NIL)
+    {
+        e = scan_table + i;
+        if ((e->addr_type == addr_type) && (0 == memcmp(e->addr, addr, BD_ADDR_LEN)))
+        {
+            scan_lru_remove(i);
+            scan_lru_append(i);
+            return e;
+        }
+        i = e->hash_next;
+    }
+
+    if (scan_used < MAX_SCAN_TABLE_SIZE)
+        i = scan_used++;
+    else
+    {
+        i = scan_lru_oldest;
+        scan_lru_remove(i);
+        scan_hash_remove(i);
+    }
+
+    e = scan_table + i;
+    memset(e, 0, sizeof(*e));
+    memcpy(e->addr, addr, BD_ADDR_LEN);
+    e->addr_type = addr_type;
+    e->first_seen = now_ms();
+    e->hash_next = *bucket;
+    *bucket = i;
+    scan_lru_append(i);
+    return e;
+}
+
+static void scan_table_update(const bd_addr_t addr, const le_ext_adv_report_t *report)
+{
+    scan_entry_t *e = scan_table_get(addr, report->addr_type);
+    uint8_t len = report->data_len > MAX_SCAN_DATA_LEN ? MAX_SCAN_DATA_LEN : report->data_len;
+
+    e->rssi = report->rssi;
+    e->last_seen = now_ms();
+    e->count++;
+    if (report->evt_type & HCI_EXT_ADV_PROP_SCAN_RSP)
+    {
+        memcpy(e->rsp_data, report->data, len);
+        e->rsp_len = len;
+    }
+    else
+    {
+        memcpy(e->adv_data, report->data, len);
+        e->adv_len = len;
+    }
+}
+
+static void stack_scan_list(void *user_data, uint16_t _)
+{
+    uint32_t since = (uint32_t)(uintptr_t)user_data;
+    uint32_t now = now_ms();
+    // addr, hex data and numbers
+    char *line = (char *)at_alloc(MAX_SCAN_DATA_LEN * 4 + 96);
+    uint8_t i;
+    int n = 0;
+
+    // from the least recently seen one
+    for (i = scan_lru_oldest; i != SCAN_NIL; i = scan_table[i].lru_next)
+    {
+        const scan_entry_t *e = scan_table + i;
+        if (e->last_seen < since) continue;
+
+        char *s = line + sprintf(line, "+BLESCANLIST:");
+        s = append_bd_addr(s, e->addr);
+        s += sprintf(s, ",%d,%d,", e->addr_type, e->rssi);
+        s = append_hex_str(s, e->adv_data, e->adv_len);
+        *s++ = ',';
+        s = append_hex_str(s, e->rsp_data, e->rsp_len);
+        s += sprintf(s, ",%u,%u,%u\n", e->first_seen, e->last_seen, e->count);
+        tx_data(line, s - line + 1);
+        n++;
+    }
+    free(line);
+
+    int len = sprintf(buffer, "+BLESCANLISTEND:%u,%d\n", now, n);
+    tx_data(buffer, len + 1);
+    at_tx_ok();
+}
+
+static void get_ble_scan_list(void)
+{
+    at_push_runnable(stack_scan_list, (void *)0, 0);
+}
+
+static void set_ble_scan_list(int argc, const char *argv[])
+{
+    if (argc < 1) goto error;
+
+    at_push_runnable(stack_scan_list, (void *)(uintptr_t)strtoul(argv[0], NULL, 10), 0);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+void at_on_adv_report(const le_ext_adv_report_t *report)
+{
+    bd_addr_t addr;
+    reverse_bd_addr(report->address, addr);
+    if (scan_param.filter_type == 1)
+    {
+        if (memcmp(addr, scan_param.filter_addr, BD_ADDR_LEN))
+            return;
+    }
+
+    scan_table_update(addr, report);
+
+    strcpy(buffer, "+BLESCAN:");
+    char *s = buffer + 9;
+    s = append_bd_addr(s, addr);
+
+    if (report->evt_type & HCI_EXT_ADV_PROP_SCAN_RSP)
+    {
+        s += sprintf(s, ",%d,,", report->rssi);
+        s = append_hex_str(s, report->data, report->data_len);
+        s += sprintf(s, ",%d", report->addr_type);
+    }
+    else
+    {
+        s += sprintf(s, ",%d,", report->rssi);
+        s = append_hex_str(s, report->data, report->data_len);
+        s += sprintf(s, ",,%d", report->addr_type);
+    }
+
+    tx_data(buffer, s - buffer + 1);
+}
+
+static void set_ble_scan(int argc, const char *argv[])
+{
+    if (argc < 1) goto error;
+    uint8_t enable = atoi(argv[0]);
+
+    if (argc >= 2)
+        scan_param.interval        = atoi(argv[1]);
+    if (argc >= 3)
+    {
+        scan_param.filter_type    = (bd_addr_type_t)atoi(argv[2]);
+        if (scan_param.filter_type > 1)
+            goto error;
+    }
+    if (argc >= 4)
+        parse_addr(argv[3], scan_param.filter_addr);
+
+    scan_param.scanning = enable;
+    at_push_runnable(stack_scan, NULL, enable);
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+// Periodic advertising sync. Reports of a train are reassembled, and a
+// payload identical to the previous one is not reported again: HCI reports
+// carry no ADI (data ID), so a hash of the data is compared instead.
+struct per_sync
+{
+    uint8_t  used;
+    uint8_t  established;
+    uint8_t  cancelled;                 // creation cancelled, waiting for its event
+    uint8_t  dedup;
+    uint16_t handle;
+    uint8_t  sid;
+    bd_addr_type_t addr_type;
+    bd_addr_t addr;
+    uint16_t len;
+    uint8_t *data;                      // reassembly buffer
+    uint8_t  overflow;                  // data longer than MAX_EXT_ADV_DATA_LEN
+    uint32_t last_hash;
+};
+
+static struct per_sync per_syncs[MAX_PER_SYNC_NUM] = {0};
+static int per_sync_creating = -1;      // index of the sync being created
+
+static void free_per_sync(struct per_sync *sync)
+{
+    if (sync->data) free(sync->data);
+    memset(sync, 0, sizeof(*sync));
+}
+
+static struct per_sync *find_per_sync(uint16_t handle)
+{
+    int i;
+    for (i = 0; i < MAX_PER_SYNC_NUM; i++)
+        if (per_syncs[i].established && (per_syncs[i].handle == handle))
+            return per_syncs + i;
+    return NULL;
+}
+
+static void stack_create_sync(void *user_data, uint16_t index)
+{
+    struct per_sync *sync = per_syncs + index;
+    uint16_t timeout = (uint16_t)(uintptr_t)user_data;
+    if (gap_periodic_adv_create_sync(PERIODIC_ADVERTISER_FROM_PARAM,
+                                     sync->sid, sync->addr_type, sync->addr,
+                                     0, timeout, 0) != 0)
+    {
+        int len = sprintf(buffer, "+BLEPERSYNC:%d,-1\n", index);
+        tx_data(buffer, len + 1);
+        free_per_sync(sync);
+        per_sync_creating = -1;
+    }
+}
+
+static void stack_stop_sync(void *user_data, uint16_t index)
+{
+    struct per_sync *sync = per_syncs + index;
+    if (0 == sync->used) return;
+    if (sync->established)
+        gap_periodic_adv_terminate_sync(sync->handle);
+    else
+    {
+        // the cancelled creation still ends with a SYNC_ESTABLISHED event:
+        // keep the slot (and per_sync_creating) until it arrives, so that the
+        // event is not taken as the result of the next AT+BLEPERSYNC
+        if (0 == sync->cancelled)
+        {
+            sync->cancelled = 1;
+            gap_periodic_adv_create_sync_cancel();
+        }
+        return;
+    }
+    free_per_sync(sync);
+}
+
+static void get_ble_per_sync(void)
+{
+    int i;
+    for (i = 0; i < MAX_PER_SYNC_NUM; i++)
+    {
+        struct per_sync *sync = per_syncs + i;
+        char *s;
+        if (0 == sync->used) continue;
+        s = buffer + sprintf(buffer, "+BLEPERSYNC:%d,", i);
+        s = append_bd_addr(s, sync->addr);
+        s += sprintf(s, ",%d,%d,%d\n", sync->addr_type, sync->sid, sync->established);
+        tx_data(buffer, s - buffer + 1);
+    }
+    at_tx_ok();
+}
+
+// AT+BLEPERSYNC=<addr>,<addr_type>,<sid>[,<timeout>[,<dedup>]]
+static void set_ble_per_sync(int argc, const char *argv[])
+{
+    int i;
+    struct per_sync *sync = NULL;
+    uint16_t timeout;
+
+    if ((argc < 3) || (per_sync_creating >= 0)) goto error;
+
+    for (i = 0; i < MAX_PER_SYNC_NUM; i++)
+    {
+        if (0 == per_syncs[i].used)
+        {
+            sync = per_syncs + i;
+            break;
+        }
+    }
+    if (NULL == sync) goto error;
+
+    if (parse_addr(argv[0], sync->addr)) goto error;
+    sync->addr_type = (bd_addr_type_t)atoi(argv[1]);
+    sync->sid = (uint8_t)atoi(argv[2]);
+    timeout = argc >= 4 ? (uint16_t)atoi(argv[3]) : 400;
+    sync->dedup = argc >= 5 ? (uint8_t)atoi(argv[4]) : 1;
+    sync->used = 1;
+    per_sync_creating = i;
+
+    at_push_runnable(stack_create_sync, (void *)(uintptr_t)timeout, i);
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+// AT+BLEPERSYNCSTOP=<sync_index>
+static void set_ble_per_sync_stop(int argc, const char *argv[])
+{
+    if (argc < 1) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= MAX_PER_SYNC_NUM) || (0 == per_syncs[id].used)) goto error;
+
+    at_push_runnable(stack_stop_sync, NULL, id);
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+void at_on_per_sync_established(const le_meta_event_periodic_adv_sync_established_t *established)
+{
+    int id = per_sync_creating;
+    struct per_sync *sync;
+    int len;
+
+    if (id < 0) return;
+    per_sync_creating = -1;
+    sync = per_syncs + id;
+
+    if (sync->cancelled)
+    {
+        // established just before the cancel took effect
+        if (0 == established->status)
+            gap_periodic_adv_terminate_sync(established->handle);
+        free_per_sync(sync);
+        return;
+    }
+
+    if (established->status)
+    {
+        len = sprintf(buffer, "+BLEPERSYNC:%d,%d\n", id, established->status);
+        free_per_sync(sync);
+    }
+    else
+    {
+        sync->established = 1;
+        sync->handle = established->handle;
+        len = sprintf(buffer, "+BLEPERSYNC:%d,0,%d,%d\n", id, established->phy, established->interval);
+    }
+    tx_data(buffer, len + 1);
+}
+
+void at_on_per_adv_report(const le_meta_event_periodic_adv_report_t *report)
+{
+    struct per_sync *sync = find_per_sync(report->handle);
+    uint32_t h;
+    char prefix[40];
+
+    if (NULL == sync) return;
+
+    if (NULL == sync->data)
+        sync->data = (uint8_t *)at_alloc(MAX_EXT_ADV_DATA_LEN);
+    if (sync->len + report->data_len <= MAX_EXT_ADV_DATA_LEN)
+    {
+        memcpy(sync->data + sync->len, report->data, report->data_len);
+        sync->len += report->data_len;
+    }
+    else
+        sync->overflow = 1;
+
+    // 1: more to come
+    if (1 == report->data_status)
+        return;
+
+    // 0: complete; 2: truncated, and no more data
+    {
+        int truncated = (0 != report->data_status) || sync->overflow;
+        h = hash_data(sync->data, sync->len) ^ truncated;
+        if ((0 == sync->dedup) || (h != sync->last_hash))
+        {
+            sync->last_hash = h;
+            sprintf(prefix, "+BLEPERADV:%d,%d,%d,%d,\"", (int)(sync - per_syncs), report->rssi,
+                    report->tx_power, truncated);
+            tx_hex_value(prefix, sync->data, sync->len, "\"\n");
+        }
+    }
+    sync->len = 0;
+    sync->overflow = 0;
+}
+
+void at_on_per_sync_lost(uint16_t handle)
+{
+    struct per_sync *sync = find_per_sync(handle);
+    int len;
+    if (NULL == sync) return;
+
+    len = sprintf(buffer, "+BLEPERSYNCLOST:%d\n", (int)(sync - per_syncs));
+    tx_data(buffer, len + 1);
+    free_per_sync(sync);
+}
+
+static void stack_gatts_read(void *user_data, uint16_t value_len)
+{
+    conn_info_t *p = (conn_info_t *)user_data;
+
+    // keep the whole value so that following Read Blob requests can be
+    // answered without asking the host again.
+    free_long_value(&p->read_response);
+    if (value_len > 0)
+    {
+        p->read_response.value_handle = p->gatts_value_info.value_handle;
+        p->read_response.data = (uint8_t *)at_alloc(value_len);
+        p->read_response.len = value_len;
+        memcpy(p->read_response.data, p->gatts_value_info.data, value_len);
+    }
+
+    uint8_t r = att_server_deferred_read_response(p->handle,
+                        p->gatts_value_info.value_handle,
+                        p->gatts_value_info.data, value_len);
+    if (0 == r) at_tx_ok(); else at_tx_error();
+}
+
+static void stack_gatts_notify(void *user_data, uint16_t value_len)
+{
+    conn_info_t *p = (conn_info_t *)user_data;
+    uint8_t r = att_server_notify(p->handle,
+                        p->gatts_value_info.value_handle,
+                        p->gatts_value_info.data, value_len);
+    if (0 == r) at_tx_ok(); else at_tx_error();
+}
+
+static void stack_gatts_indicate(void *user_data, uint16_t value_len)
+{
+    conn_info_t *p = (conn_info_t *)user_data;
+    uint8_t r = att_server_indicate(p->handle,
+                        p->gatts_value_info.value_handle,
+                        p->gatts_value_info.data, value_len);
+    if (0 == r) at_tx_ok(); else at_tx_error();
+}
+
+static void set_ble_gatts_read(int argc, const char *argv[])
+{
+    if (argc != 3) goto error;
+
+    uint8_t id = (uint8_t)atoi(argv[0]);
+    conn_info_t *p = &conn_infos[id];
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    p->gatts_value_info.value_handle = (uint16_t)atoi(argv[1]);
+
+    uint16_t len = (uint16_t)load_hex_data(argv[2], (uint8_t *)argv[2]);
+    p->gatts_value_info.data = (uint8_t *)argv[2];
+
+    at_push_runnable(stack_gatts_read, p, len);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void set_ble_gatts_write(int argc, const char *argv[])
+{
+    if (argc != 4) goto error;
+
+    uint8_t id = (uint8_t)atoi(argv[0]);
+    conn_info_t *p = &conn_infos[id];
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    p->gatts_value_info.value_handle = (uint16_t)atoi(argv[1]);
+    uint8_t mode = (uint8_t)atoi(argv[2]);
+    uint16_t len = (uint16_t)load_hex_data(argv[3], (uint8_t *)argv[3]);
+    p->gatts_value_info.data = (uint8_t *)argv[3];
+
+    at_push_runnable(mode == 0 ? stack_gatts_notify : stack_gatts_indicate, p, len);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+// values of attributes given by AT+BLEGATTSSET, served without the host.
+// accessed in stack context only.
+static struct long_value gatts_cache[MAX_GATTS_CACHE_NUM] = {0};
+
+static struct long_value *gatts_cache_find(uint16_t att_handle)
+{
+    int i;
+    for (i = 0; i < MAX_GATTS_CACHE_NUM; i++)
+    {
+        if (gatts_cache[i].data && (gatts_cache[i].value_handle == att_handle))
+            return gatts_cache + i;
+    }
+    return NULL;
+}
+
+static void gatts_cache_update(uint16_t att_handle, const uint8_t *value, uint16_t len)
+{
+    struct long_value *v = gatts_cache_find(att_handle);
+    if (NULL == v) return;
+    free(v->data);
+    v->data = (uint8_t *)at_alloc(len + 1);
+    v->len = len;
+    memcpy(v->data, value, len);
+}
+
+static void stack_gatts_set(void *user_data, uint16_t att_handle)
+{
+    struct long_value *value = (struct long_value *)user_data;
+    struct long_value *v = gatts_cache_find(att_handle);
+
+    if (v)
+        free_long_value(v);
+
+    if (NULL == value)
+    {
+        at_tx_ok();
+        return;
+    }
+
+    if (NULL == v)
+    {
+        int i;
+        for (i = 0; i < MAX_GATTS_CACHE_NUM; i++)
+            if (NULL == gatts_cache[i].data) break;
+        if (i >= MAX_GATTS_CACHE_NUM)
+        {
+            free(value->data);
+            free(value);
+            at_tx_error();
+            return;
+        }
+        v = gatts_cache + i;
+    }
+
+    *v = *value;
+    free(value);
+    at_tx_ok();
+}
+
+static void set_ble_gatts_set(int argc, const char *argv[])
+{
+    struct long_value *value = NULL;
+    if (argc < 1) goto error;
+
+    uint16_t att_handle = (uint16_t)atoi(argv[0]);
+    if (0 == att_handle) goto error;
+
+    if (argc >= 2)
+    {
+        int len = strlen(argv[1]) / 2;
+        if (len > MAX_LONG_VALUE_SIZE) goto error;
+
+        value = (struct long_value *)at_alloc(sizeof(struct long_value));
+        value->value_handle = att_handle;
+        // one extra byte, so that empty values are still allocated
+        value->data = (uint8_t *)at_alloc(len + 1);
+        value->len = (uint16_t)load_hex_data(argv[1], value->data);
+    }
+
+    at_push_runnable(stack_gatts_set, value, att_handle);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void get_ble_conn(void)
+{
+    int i;
+    for (i = 0; i < TOTAL_CONN_NUM; i++)
+    {
+        conn_info_t *p = conn_infos + i;
+        if (p->handle == INVALID_HANDLE) continue;
+        char *s = buffer + sprintf(buffer, "+BLECONN:%d,", i);
+        s = append_bd_addr(s, p->peer_addr);
+        strcpy(s, "\n");
+        s++;
+        tx_data(buffer, s - buffer + 1);
+    }
+    at_tx_ok();
+}
+
+static void stack_cancel_create_conn(void *data, uint16_t index)
+{
+    gap_create_connection_cancel();
+}
+
+static void initiate_timeout(void)
+{
+    btstack_push_user_runnable(stack_cancel_create_conn, NULL, 0);
+}
+
+static void stack_initiate(void *data, uint16_t index)
+{
+    conn_info_t *p = conn_infos + index;
+    initiating_phy_config_t phy_configs[] =
+    {
+        {
+            .phy = PHY_1M,
+            .conn_param =
+            {
+                .scan_int = 150,
+                .scan_win = 100,
+                .interval_min = p->min_interval,
+                .interval_max = p->max_interval,
+                .latency = p->latency,
+                .supervision_timeout = p->timeout,
+                .min_ce_len = 7,
+                .max_ce_len = 7
+            }
+        },
+        {
+            .phy = PHY_CODED,
+            .conn_param =
+            {
+                .scan_int = 150,
+                .scan_win = 100,
+                .interval_min = p->min_interval,
+                .interval_max = p->max_interval,
+                .latency = p->latency,
+                .supervision_timeout = p->timeout,
+                .min_ce_len = 7,
+                .max_ce_len = 7
+            }
+        }
+    };
+    // also initiate on Coded PHY if it is preferred, for long range peers
+    int phy_num = (p->tx_phys & PHY_CODED_BIT) ? 2 : 1;
+
+    if (gap_ext_create_connection(
+                INITIATING_ADVERTISER_FROM_PARAM,
+                BD_ADDR_TYPE_LE_RANDOM,
+                p->peer_addr_type,
+                p->peer_addr,
+                phy_num,
+                phy_configs) == 0)
+    {
+        initiating_index = index;
+        platform_set_timer(initiate_timeout, initiating_timeout * 1600);
+    }
+}
+
+static void set_ble_conn(int argc, const char *argv[])
+{
+    if (initiating_index >= 0) goto error;
+
+    if (argc < 2) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= MAX_CONN_AS_MASTER)) goto error;
+    conn_info_t *p = conn_infos + id;
+    parse_addr(argv[1], p->peer_addr);
+
+    if (argc >= 3)
+        p->peer_addr_type = (bd_addr_type_t)atoi(argv[2]);
+    if (argc >= 4)
+        initiating_timeout = atoi(argv[3]);
+
+    at_push_runnable(stack_initiate, NULL, (uint16_t)id);
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void stack_disconn(void *data, uint16_t index)
+{
+    gap_disconnect(index);
+}
+
+static void set_ble_disconn(int argc, const char *argv[])
+{
+    if (argc < 1) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    at_push_runnable(stack_disconn, NULL, get_handle_of_id(id));
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+conn_info_t *get_conn_by_addr(bd_addr_type_t type, const uint8_t *addr)
+{
+    int i;
+    for (i = 0; i < MAX_CONN_AS_MASTER; i++)
+    {
+        if ((conn_infos[i].peer_addr_type == type)
+            && (memcmp(conn_infos[i].peer_addr, addr, sizeof(conn_infos[i].peer_addr)) == 0))
+            return conn_infos + i;
+    }
+    return NULL;
+}
+
+static void get_ble_conn_param(void)
+{
+    int i;
+    for (i = 0; i < TOTAL_CONN_NUM; i++)
+    {
+        conn_info_t *p = conn_infos + i;
+        if (p->handle == INVALID_HANDLE) continue;
+        int len = sprintf(buffer, "+BLECONNPARAM:%d,%d,%d,%d,%d,%d",
+            i, p->min_interval, p->max_interval, p->cur_interval,
+            p->latency, p->timeout);
+        tx_data(buffer, len + 1);
+    }
+}
+
+static void stack_update_conn(void *data, uint16_t index)
+{
+    conn_info_t *p = conn_infos + index;
+    gap_update_connection_parameters(p->handle,
+        p->min_interval, p->max_interval, p->latency, p->timeout, 7, 7);
+}
+
+static void set_ble_conn_param(int argc, const char *argv[])
+{
+    if (argc < 5) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    p->min_interval = (uint16_t)atoi(argv[1]);
+    p->max_interval = (uint16_t)atoi(argv[2]);
+    p->latency      = (uint16_t)atoi(argv[3]);
+    p->timeout      = (uint16_t)atoi(argv[4]);
+
+    at_push_runnable(stack_update_conn, NULL, get_handle_of_id(id));
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void stack_set_phy(void *data, uint16_t index)
+{
+    conn_info_t *p = conn_infos + index;
+    if ((p->handle == INVALID_HANDLE) || (0 == p->tx_phys)) return;
+    gap_set_phy(p->handle, 0, (phy_bittypes_t)p->tx_phys, (phy_bittypes_t)p->rx_phys,
+                (phy_option_t)p->phy_opt);
+}
+
+static void get_ble_conn_phy(void)
+{
+    int i;
+    for (i = 0; i < TOTAL_CONN_NUM; i++)
+    {
+        conn_info_t *p = conn_infos + i;
+        int len;
+        if (p->handle == INVALID_HANDLE) continue;
+        len = sprintf(buffer, "+BLECONNPHY:%d,%d,%d,%d,%d,%d\n",
+            i, p->tx_phys, p->rx_phys, p->phy_opt, p->tx_phy, p->rx_phy);
+        tx_data(buffer, len + 1);
+    }
+    at_tx_ok();
+}
+
+// AT+BLECONNPHY=<conn_index>,<tx_phys>,<rx_phys>[,<phy_opt>]
+// The preference is kept for the link (or the slot, if not connected yet)
+// and requested whenever it gets connected.
+static void set_ble_conn_phy(int argc, const char *argv[])
+{
+    if (argc < 3) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    uint8_t all = PHY_1M_BIT | PHY_2M_BIT | PHY_CODED_BIT;
+    int tx_phys = atoi(argv[1]);
+    int rx_phys = atoi(argv[2]);
+    int phy_opt = argc >= 4 ? atoi(argv[3]) : HOST_NO_PREFERRED_CODING;
+
+    // checked as a whole, so that an error leaves the preference as is
+    if (   (tx_phys < 0) || (tx_phys & ~all) || (rx_phys < 0) || (rx_phys & ~all)
+        || (phy_opt < HOST_NO_PREFERRED_CODING) || (phy_opt > HOST_PREFER_S8_CODING))
+        goto error;
+
+    p->tx_phys = (uint8_t)tx_phys;
+    p->rx_phys = (uint8_t)rx_phys;
+    p->phy_opt = (uint8_t)phy_opt;
+
+    if (p->handle != INVALID_HANDLE)
+        at_push_runnable(stack_set_phy, NULL, id);
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+void at_on_phy_update(const le_meta_phy_update_complete_t *complete)
+{
+    int id = get_id_of_handle(complete->handle);
+    conn_info_t *p = conn_infos + id;
+    int len;
+    if (p->handle != complete->handle) return;
+
+    if (0 == complete->status)
+    {
+        p->tx_phy = complete->tx_phy;
+        p->rx_phy = complete->rx_phy;
+    }
+    len = sprintf(buffer, "+BLEPHY:%d,%d,%d,%d\n", id, complete->status, p->tx_phy, p->rx_phy);
+    tx_data(buffer, len + 1);
+}
+
+void at_on_read_phy(uint8_t status, uint16_t handle, uint8_t tx_phy, uint8_t rx_phy)
+{
+    conn_info_t *p;
+    if ((status != 0) || (handle >= sizeof(handle_2_id))) return;
+
+    p = conn_infos + get_id_of_handle(handle);
+    if (p->handle != handle) return;
+    p->tx_phy = tx_phy;
+    p->rx_phy = rx_phy;
+}
+
+// Link quality of all connections is sampled and reported in one line per
+// period: one timer and one UART line, whatever the number of links.
+#define LQ_RSSI_UNKNOWN             127
+
+static uint32_t lq_period = 0;          // ms; 0: disabled
+static uint8_t lq_pending = 0;          // RSSI reads waiting for results
+
+static void lq_report(void)
+{
+    // ";<id>,<rssi>,<tx_phy>,<rx_phy>,<interval>,<errors>" is 32 bytes at most
+    char *line = (char *)at_alloc(TOTAL_CONN_NUM * 32 + 16);
+    char *s = line + sprintf(line, "+BLELQ:");
+    int i;
+
+    for (i = 0; i < TOTAL_CONN_NUM; i++)
+    {
+        conn_info_t *p = conn_infos + i;
+        if (p->handle == INVALID_HANDLE) continue;
+        if (s[-1] != ':') *s++ = ';';
+        s += sprintf(s, "%d,%d,%d,%d,%d,%u", i, p->lq.waiting ? LQ_RSSI_UNKNOWN : p->lq.rssi,
+                     p->tx_phy, p->rx_phy, p->cur_interval, p->lq.errors);
+        p->lq.errors = 0;
+        p->lq.waiting = 0;
+    }
+    lq_pending = 0;
+
+    if (s[-1] != ':')
+    {
+        strcpy(s, "\n");
+        tx_data(line, s - line + 2);
+    }
+    free(line);
+}
+
+static void lq_timer_callback(void)
+{
+    int i;
+
+    if (0 == lq_period) return;
+
+    // results not back within a period are reported as unknown
+    if (lq_pending) lq_report();
+
+    platform_set_timer(lq_timer_callback, lq_period * 1600 / 1000);
+
+    for (i = 0; i < TOTAL_CONN_NUM; i++)
+    {
+        conn_info_t *p = conn_infos + i;
+        if (p->handle == INVALID_HANDLE) continue;
+        if (gap_read_rssi(p->handle) != 0)
+        {
+            p->lq.rssi = LQ_RSSI_UNKNOWN;
+            continue;
+        }
+        p->lq.waiting = 1;
+        lq_pending++;
+    }
+
+    // no read is issued: report now, with RSSI unknown
+    if (0 == lq_pending) lq_report();
+}
+
+void at_on_read_rssi(uint8_t status, uint16_t handle, int8_t rssi)
+{
+    conn_info_t *p;
+    if (handle >= sizeof(handle_2_id)) return;
+
+    p = conn_infos + get_id_of_handle(handle);
+    if ((p->handle != handle) || !p->lq.waiting) return;
+
+    p->lq.rssi = status ? LQ_RSSI_UNKNOWN : rssi;
+    p->lq.waiting = 0;
+    if (--lq_pending == 0)
+        lq_report();
+}
+
+static void stack_set_lq(void *user_data, uint16_t _)
+{
+    lq_period = (uint32_t)(uintptr_t)user_data;
+    if (lq_period)
+        platform_set_timer(lq_timer_callback, lq_period * 1600 / 1000);
+    else
+        platform_set_timer(lq_timer_callback, 0);
+    at_tx_ok();
+}
+
+static void set_ble_lq(int argc, const char *argv[])
+{
+    if (argc < 1) goto error;
+
+    int period = atoi(argv[0]);
+    if ((period != 0) && ((period < MIN_LQ_PERIOD) || (period > MAX_LQ_PERIOD))) goto error;
+
+    at_push_runnable(stack_set_lq, (void *)(uintptr_t)period, 0);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static int print_uuid(char *s, const uint8_t *uuid)
+{
+    if (uuid_has_bluetooth_prefix(uuid))
+    {
+        return sprintf(s, "%04x", (uuid[2] << 8) | uuid[3]);
+    }
+    else
+        return sprintf(s, "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+                        uuid[0], uuid[1], uuid[2], uuid[3],
+                        uuid[4], uuid[5], uuid[6], uuid[7], uuid[8], uuid[9],
+                        uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+}
+
+// GATT database built at runtime. It starts with the static profile, so
+// that handles of the static services (FOTA etc) are kept.
+extern const uint8_t *get_static_profile(uint16_t *size);
+
+static uint8_t *gatt_db = NULL;         // database in use, NULL for the static one
+static uint16_t gatt_db_size = 0;
+
+// The saved database is prefixed with the size and CRC of the static profile
+// it is built on, and dropped when the static profile changes (handles moved).
+#define GATT_DB_STAMP_SIZE      4
+
+static struct
+{
+    uint8_t *db;
+    uint16_t size;
+    uint16_t next_handle;
+    uint8_t has_service;
+} db_builder = {0};
+
+#define ATT_ENTRY_HEADER_SIZE   6
+
+static void store_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static uint16_t read_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+// returns length of the UUID (2 or 16), which is stored in little endian.
+static int parse_uuid(const char *s, uint8_t *uuid)
+{
+    uint8_t be[16];
+    int i, n = 0;
+    while (*s)
+    {
+        if (*s == '-')
+        {
+            s++;
+            continue;
+        }
+        if ((n >= sizeof(be)) || (s[1] == '\0'))
+            return 0;
+        be[n++] = (char_to_nibble(s[0]) << 4) | char_to_nibble(s[1]);
+        s += 2;
+    }
+    if ((n != 2) && (n != 16))
+        return 0;
+    for (i = 0; i < n; i++)
+        uuid[i] = be[n - 1 - i];
+    return n;
+}
+
+static int print_le_uuid(char *s, const uint8_t *uuid, int len)
+{
+    uint8_t be[16];
+    int i;
+    if (len == 2)
+        return sprintf(s, "%04x", read_le16(uuid));
+    for (i = 0; i < 16; i++)
+        be[i] = uuid[15 - i];
+    return print_uuid(s, be);
+}
+
+static uint16_t db_add_attribute(uint16_t flags, uint16_t type, const uint8_t *type128,
+                                 const uint8_t *value, int value_len)
+{
+    int type_len = type128 ? 16 : 2;
+    int size = ATT_ENTRY_HEADER_SIZE + type_len + value_len;
+    uint8_t *p = db_builder.db + db_builder.size;
+
+    // 2 bytes are reserved for the terminator
+    if (db_builder.size + size + 2 > MAX_RUNTIME_DB_SIZE)
+        return 0;
+
+    store_le16(p + 0, size);
+    store_le16(p + 2, flags | (type128 ? ATT_PROPERTY_UUID128 : 0));
+    store_le16(p + 4, db_builder.next_handle);
+    if (type128)
+        memcpy(p + ATT_ENTRY_HEADER_SIZE, type128, 16);
+    else
+        store_le16(p + ATT_ENTRY_HEADER_SIZE, type);
+    memcpy(p + ATT_ENTRY_HEADER_SIZE + type_len, value, value_len);
+
+    db_builder.size += size;
+    return db_builder.next_handle++;
+}
+
+static void db_builder_start(void)
+{
+    uint16_t size;
+    const uint8_t *base = get_static_profile(&size);
+    const uint8_t *p = base;
+
+    if (db_builder.db) return;
+
+    db_builder.db = (uint8_t *)at_alloc(MAX_RUNTIME_DB_SIZE);
+    db_builder.next_handle = 1;
+    db_builder.has_service = 0;
+
+    while (read_le16(p))
+    {
+        uint16_t handle = read_le16(p + 4);
+        if (handle >= db_builder.next_handle)
+            db_builder.next_handle = handle + 1;
+        p += read_le16(p);
+    }
+    db_builder.size = p - base;
+    memcpy(db_builder.db, base, db_builder.size);
+}
+
+static void db_builder_discard(void)
+{
+    if (db_builder.db) free(db_builder.db);
+    memset(&db_builder, 0, sizeof(db_builder));
+}
+
+static void report_gatt_db(const uint8_t *db)
+{
+    char *s;
+    while (read_le16(db))
+    {
+        int size = read_le16(db);
+        uint16_t flags = read_le16(db + 2);
+        uint16_t handle = read_le16(db + 4);
+        const uint8_t *value = db + ATT_ENTRY_HEADER_SIZE + ((flags & ATT_PROPERTY_UUID128) ? 16 : 2);
+        int value_len = size - (value - db);
+        uint16_t type = (flags & ATT_PROPERTY_UUID128) ? 0 : read_le16(db + ATT_ENTRY_HEADER_SIZE);
+
+        if (GATT_PRIMARY_SERVICE_UUID == type)
+        {
+            s = buffer + sprintf(buffer, "+BLEGATTSDBSRV:%d,", handle);
+            s += print_le_uuid(s, value, value_len);
+            strcpy(s, "\n");
+            tx_data(buffer, s - buffer + 2);
+        }
+        else if (GATT_CHARACTERISTICS_UUID == type)
+        {
+            s = buffer + sprintf(buffer, "+BLEGATTSDBCHAR:%d,%d,", read_le16(value + 1), value[0]);
+            s += print_le_uuid(s, value + 3, value_len - 3);
+            strcpy(s, "\n");
+            tx_data(buffer, s - buffer + 2);
+        }
+
+        db += size;
+    }
+}
+
+static void stamp_static_profile(uint8_t *stamp)
+{
+    uint16_t size;
+    const uint8_t *base = get_static_profile(&size);
+    store_le16(stamp, size);
+    store_le16(stamp + 2, crc((uint8_t *)base, size));
+}
+
+static void save_gatt_db(void)
+{
+    uint8_t *value = (uint8_t *)at_alloc(GATT_DB_STAMP_SIZE + gatt_db_size);
+    stamp_static_profile(value);
+    memcpy(value + GATT_DB_STAMP_SIZE, gatt_db, gatt_db_size);
+    kv_put(KV_KEY_GATT_DB, value, GATT_DB_STAMP_SIZE + gatt_db_size);
+    free(value);
+}
+
+static void set_ble_gatts_srv(int argc, const char *argv[])
+{
+    uint8_t uuid[16];
+    if (argc < 1) goto error;
+
+    int len = parse_uuid(argv[0], uuid);
+    if (0 == len) goto error;
+
+    db_builder_start();
+    uint16_t handle = db_add_attribute(ATT_PROPERTY_READ, GATT_PRIMARY_SERVICE_UUID, NULL, uuid, len);
+    if (0 == handle) goto error;
+    db_builder.has_service = 1;
+
+    len = sprintf(buffer, "+BLEGATTSSRV:%d\n", handle);
+    tx_data(buffer, len + 1);
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void set_ble_gatts_char(int argc, const char *argv[])
+{
+    uint8_t uuid[16];
+    uint8_t decl[3 + 16];
+    uint8_t cccd[2] = {0};
+    uint16_t cccd_handle = 0;
+    if (argc < 2) goto error;
+    if (0 == db_builder.has_service) goto error;
+
+    int len = parse_uuid(argv[0], uuid);
+    if (0 == len) goto error;
+    uint8_t props = (uint8_t)atoi(argv[1]);
+
+    decl[0] = props;
+    store_le16(decl + 1, db_builder.next_handle + 1);
+    memcpy(decl + 3, uuid, len);
+    if (0 == db_add_attribute(ATT_PROPERTY_READ, GATT_CHARACTERISTICS_UUID, NULL, decl, 3 + len))
+        goto error;
+
+    // all values are dynamic, i.e. handled by at_att_read/write_callback
+    uint16_t value_handle = db_add_attribute(props | ATT_PROPERTY_DYNAMIC,
+                                            len == 2 ? read_le16(uuid) : 0,
+                                            len == 16 ? uuid : NULL,
+                                            NULL, 0);
+    if (0 == value_handle) goto error;
+
+    if (props & (ATT_PROPERTY_NOTIFY | ATT_PROPERTY_INDICATE))
+    {
+        cccd_handle = db_add_attribute(ATT_PROPERTY_READ | ATT_PROPERTY_WRITE | ATT_PROPERTY_DYNAMIC,
+                                       GATT_CLIENT_CHARACTERISTICS_CONFIGURATION, NULL,
+                                       cccd, sizeof(cccd));
+        if (0 == cccd_handle) goto error;
+    }
+
+    len = sprintf(buffer, "+BLEGATTSCHAR:%d,%d\n", value_handle, cccd_handle);
+    tx_data(buffer, len + 1);
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void stack_use_gatt_db(void *user_data, uint16_t size)
+{
+    int i;
+    for (i = MAX_CONN_AS_MASTER; i < TOTAL_CONN_NUM; i++)
+    {
+        // the database may be in use by connected clients
+        if (conn_infos[i].handle != INVALID_HANDLE)
+        {
+            if (user_data) free(user_data);
+            at_tx_error();
+            return;
+        }
+    }
+
+    if (gatt_db) free(gatt_db);
+    gatt_db = (uint8_t *)user_data;
+    gatt_db_size = size;
+
+    if (gatt_db)
+    {
+        save_gatt_db();
+        report_gatt_db(gatt_db);
+    }
+    else
+        kv_remove(KV_KEY_GATT_DB);
+    kv_commit(1);
+
+    at_tx_ok();
+}
+
+static void get_ble_gatts_db(void)
+{
+    uint16_t size;
+    const uint8_t *db = gatt_db ? gatt_db : get_static_profile(&size);
+    report_gatt_db(db);
+    at_tx_ok();
+}
+
+static void set_ble_gatts_db(int argc, const char *argv[])
+{
+    if (argc < 1) goto error;
+
+    switch (atoi(argv[0]))
+    {
+    case 0:
+        db_builder_discard();
+        at_tx_ok();
+        break;
+    case 1:
+        {
+            uint8_t *db;
+            uint16_t size;
+            if (0 == db_builder.has_service) goto error;
+
+            size = db_builder.size + 2;
+            db = (uint8_t *)realloc(db_builder.db, size);
+            if (NULL == db) goto error;
+            store_le16(db + db_builder.size, 0);
+
+            db_builder.db = NULL;
+            db_builder_discard();
+            at_push_runnable(stack_use_gatt_db, db, size);
+        }
+        break;
+    case 2:
+        db_builder_discard();
+        at_push_runnable(stack_use_gatt_db, NULL, 0);
+        break;
+    default:
+        goto error;
+    }
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void load_gatt_db(void)
+{
+    int16_t size = 0;
+    uint8_t stamp[GATT_DB_STAMP_SIZE];
+    const uint8_t *value = kv_get(KV_KEY_GATT_DB, &size);
+    if (NULL == value) return;
+
+    stamp_static_profile(stamp);
+    if ((size <= GATT_DB_STAMP_SIZE + 2) || memcmp(value, stamp, sizeof(stamp)))
+    {
+        // saved by another firmware, handles may not match the static profile
+        kv_remove(KV_KEY_GATT_DB);
+        kv_commit(1);
+        return;
+    }
+
+    size -= GATT_DB_STAMP_SIZE;
+    gatt_db = (uint8_t *)at_alloc(size);
+    gatt_db_size = size;
+    memcpy(gatt_db, value + GATT_DB_STAMP_SIZE, size);
+}
+
+const uint8_t *at_get_gatt_db(void)
+{
+    return gatt_db;
+}
+
+static void gattc_done(conn_info_t *p, uint8_t status);
+
+static void gatt_client_dump_profile(service_node_t *first, void *user_data, int err_code)
+{
+    service_node_t *s = first;
+    conn_info_t *p = (conn_info_t *)user_data;
+    int id = p - conn_infos;
+
+    gattc_report_begin(p->handle);
+    while (s)
+    {
+        char_node_t *c = s->chars;
+        char *str = buffer + sprintf(buffer, "+BLEGATTCPRIMSRV:%d,%d,%d,",
+            id, s->service.start_group_handle, s->service.end_group_handle);
+        str += print_uuid(str, s->service.uuid128);
+        strcpy(str, "\n");
+        tx_data(buffer, str - buffer + 2);
+
+        while (c)
+        {
+            str = buffer + sprintf(buffer, "+BLEGATTCCHAR:%d,%d,%d,%d,%d,",
+                id, c->chara.start_handle, c->chara.end_handle, c->chara.value_handle,
+                c->chara.properties);
+            str += print_uuid(str, c->chara.uuid128);
+            strcpy(str, "\n");
+            tx_data(buffer, str - buffer + 2);
+
+            desc_node_t *d = c->descs;
+            while (d)
+            {
+                str = buffer + sprintf(buffer, "+BLEGATTCDESC:%d,%d,",
+                    id, d->desc.handle);
+                str += print_uuid(str, d->desc.uuid128);
+                strcpy(str, "\n");
+                tx_data(buffer, str - buffer + 2);
+
+                d = d->next;
+            }
+            c = c->next;
+        }
+        s = s->next;
+    }
 
     int len = sprintf(buffer, "+BLEGATTCC:%d,%d\n", id, err_code);
     tx_data(buffer, len + 1);
-    gatt_client_util_free(p->discoverer);
-    p->discoverer = NULL;
+    gattc_report_end();
+    gatt_client_util_free(p->discoverer);
+    p->discoverer = NULL;
+    gattc_done(p, err_code);
+}
+
+void read_characteristic_value_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+{
+    gattc_report_begin(channel);
+    switch (packet[0])
+    {
+    case GATT_EVENT_CHARACTERISTIC_VALUE_QUERY_RESULT:
+        {
+            uint16_t value_size;
+            const gatt_event_value_packet_t *value =
+                gatt_event_characteristic_value_query_result_parse(packet, size, &value_size);
+
+            char *s = buffer + sprintf(buffer, "+BLEGATTCRD:%d,%d,0,", get_id_of_handle(channel), value->handle);
+            s = append_hex_str(s, value->value, value_size);
+            strcpy(s, "\n");
+            tx_data(buffer, s - buffer + 2);
+        }
+        break;
+    case GATT_EVENT_QUERY_COMPLETE:
+        {
+            const gatt_event_query_complete_t *complete = gatt_event_query_complete_parse(packet);
+            if (complete->status != 0)
+            {
+                int len = sprintf(buffer, "+BLEGATTCRD:%d,%d,%d\n", get_id_of_handle(channel), complete->handle, complete->status);
+                tx_data(buffer, len + 1);
+            }
+            gattc_done(conn_infos + get_id_of_handle(channel), complete->status);
+        }
+        break;
+    }
+    gattc_report_end();
+}
+
+static void read_long_value_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+{
+    conn_info_t *p = conn_infos + get_id_of_handle(channel);
+    struct long_value *v = &p->client_long;
+    gattc_report_begin(channel);
+
+    switch (packet[0])
+    {
+    case GATT_EVENT_LONG_CHARACTERISTIC_VALUE_QUERY_RESULT:
+        {
+            uint16_t value_size;
+            const gatt_event_long_value_packet_t *value =
+                gatt_event_long_characteristic_value_query_result_parse(packet, size, &value_size);
+            if (value->offset + value_size > MAX_LONG_VALUE_SIZE)
+            {
+                // drop the rest, the value is reported as truncated
+                v->len = MAX_LONG_VALUE_SIZE + 1;
+                break;
+            }
+            memcpy(v->data + value->offset, value->value, value_size);
+            v->len = value->offset + value_size;
+        }
+        break;
+    case GATT_EVENT_QUERY_COMPLETE:
+        {
+            const gatt_event_query_complete_t *complete = gatt_event_query_complete_parse(packet);
+            uint8_t status = complete->status;
+            if ((0 == status) && (v->len > MAX_LONG_VALUE_SIZE))
+                status = ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+
+            if (status != 0)
+            {
+                int len = sprintf(buffer, "+BLEGATTCRDL:%d,%d,%d\n", get_id_of_handle(channel), v->value_handle, status);
+                tx_data(buffer, len + 1);
+            }
+            else
+            {
+                sprintf(buffer, "+BLEGATTCRDL:%d,%d,0,", get_id_of_handle(channel), v->value_handle);
+                tx_hex_value(buffer, v->data, v->len, "\n");
+            }
+            free_long_value(v);
+            gattc_done(p, status);
+        }
+        break;
+    }
+    gattc_report_end();
+}
+
+static void write_long_value_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+{
+    conn_info_t *p = conn_infos + get_id_of_handle(channel);
+    gattc_report_begin(channel);
+
+    switch (packet[0])
+    {
+    case GATT_EVENT_QUERY_COMPLETE:
+        {
+            const gatt_event_query_complete_t *complete = gatt_event_query_complete_parse(packet);
+            int len = sprintf(buffer, "+BLEGATTCWRL:%d,%d,%d\n", get_id_of_handle(channel),
+                              p->gattc.first ? p->gattc.first->value_handle : 0, complete->status);
+            tx_data(buffer, len + 1);
+            gattc_done(p, complete->status);
+        }
+        break;
+    }
+    gattc_report_end();
+}
+
+static void read_multiple_values_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+{
+    gattc_report_begin(channel);
+    switch (packet[0])
+    {
+    case GATT_EVENT_CHARACTERISTIC_VALUE_QUERY_RESULT:
+        {
+            uint16_t value_size;
+            const gatt_event_value_packet_t *value =
+                gatt_event_characteristic_value_query_result_parse(packet, size, &value_size);
+
+            sprintf(buffer, "+BLEGATTCRDM:%d,0,", get_id_of_handle(channel));
+            tx_hex_value(buffer, value->value, value_size, "\n");
+        }
+        break;
+    case GATT_EVENT_QUERY_COMPLETE:
+        {
+            const gatt_event_query_complete_t *complete = gatt_event_query_complete_parse(packet);
+            if (complete->status != 0)
+            {
+                int len = sprintf(buffer, "+BLEGATTCRDM:%d,%d\n", get_id_of_handle(channel), complete->status);
+                tx_data(buffer, len + 1);
+            }
+            gattc_done(conn_infos + get_id_of_handle(channel), complete->status);
+        }
+        break;
+    }
+    gattc_report_end();
+}
+
+void write_characteristic_value_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+{
+    gattc_report_begin(channel);
+    switch (packet[0])
+    {
+    case GATT_EVENT_QUERY_COMPLETE:
+        {
+            const gatt_event_query_complete_t *complete = gatt_event_query_complete_parse(packet);
+            int len = sprintf(buffer, "+BLEGATTCWR:%d,%d,%d\n", get_id_of_handle(channel), complete->handle, complete->status);
+            tx_data(buffer, len + 1);
+            gattc_done(conn_infos + get_id_of_handle(channel), complete->status);
+        }
+        break;
+    }
+    gattc_report_end();
+}
+
+static int tput_rx_data(conn_info_t *p, uint16_t value_handle, const uint8_t *value, uint16_t len);
+
+static void output_notification_handler(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+{
+    const gatt_event_value_packet_t *value;
+    uint16_t value_size = 0;
+    int len = 0;
+    switch (packet[0])
+    {
+    case GATT_EVENT_NOTIFICATION:
+        value = gatt_event_notification_parse(packet, size, &value_size);
+        strcpy(buffer, "+BLEGATTCNOTI");
+        len = 13;
+        break;
+    case GATT_EVENT_INDICATION:
+        value = gatt_event_indication_parse(packet, size, &value_size);
+        strcpy(buffer, "+BLEGATTCIND");
+        len = 12;
+        break;
+    }
+    if (value_size < 1) return;
+    if (tput_rx_data(conn_infos + get_id_of_handle(channel), value->handle, value->value, value_size))
+        return;
+    char *s = buffer + len;
+    s += sprintf(s, ":%d,%d,", get_id_of_handle(channel), value->handle);
+    s = append_hex_str(s, value->value, value_size);
+    strcpy(s, "\n");
+    tx_data(buffer, s - buffer + 2);
+}
+
+static void write_characteristic_descriptor_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+{
+    gattc_report_begin(channel);
+    switch (packet[0])
+    {
+    case GATT_EVENT_QUERY_COMPLETE:
+        {
+            const gatt_event_query_complete_t *complete = gatt_event_query_complete_parse(packet);
+            int len = sprintf(buffer, "+BLEGATTCSUB:%d,%d,%d\n", get_id_of_handle(channel), complete->handle, complete->status);
+            tx_data(buffer, len + 1);
+            gattc_done(conn_infos + get_id_of_handle(channel), complete->status);
+        }
+        break;
+    }
+    gattc_report_end();
+}
+
+static uint8_t gattc_sub(conn_info_t *p, const gattc_op_t *op)
+{
+    notification_handler_t *first = p->first_handler;
+
+    while (first)
+    {
+        if (first->value_handle == op->value_handle) break;
+        first = first->next;
+    }
+
+    if (NULL == first) return BTSTACK_MEMORY_ALLOC_FAILED;
+
+    if (first->registered == 0)
+    {
+        gatt_client_listen_for_characteristic_value_updates(
+            &first->notification, output_notification_handler,
+            p->handle, first->value_handle);
+        first->registered = 1;
+    }
+
+    return gatt_client_write_characteristic_descriptor_using_descriptor_handle(
+        write_characteristic_descriptor_callback,
+        p->handle,
+        op->desc_handle,
+        op->len,
+        (uint8_t *)op->data);
+}
+
+static uint8_t ping_send(conn_info_t *p, uint16_t value_handle);
+static void stack_ping_next(void *user_data, uint16_t id);
+
+static void ping_report(conn_info_t *p, uint8_t status)
+{
+    struct ping_info *g = &p->ping;
+    uint32_t min = 0, max = 0, p90 = 0;
+    uint64_t sum = 0;
+    int i, j;
+
+    // insertion sort: there are only a few samples
+    for (i = 1; i < g->done; i++)
+    {
+        uint32_t v = g->samples[i];
+        for (j = i; (j > 0) && (g->samples[j - 1] > v); j--)
+            g->samples[j] = g->samples[j - 1];
+        g->samples[j] = v;
+    }
+    for (i = 0; i < g->done; i++)
+        sum += g->samples[i];
+
+    if (g->done > 0)
+    {
+        min = g->samples[0];
+        max = g->samples[g->done - 1];
+        // nearest rank
+        p90 = g->samples[(g->done * 9 + 9) / 10 - 1];
+    }
+
+    int len = sprintf(buffer, "+BLEPING:%d,%d,%d,%u,%u,%u,%u,%u\n", (int)(p - conn_infos), status,
+                      g->done, min, g->done ? (uint32_t)(sum / g->done) : 0, max, p90,
+                      (uint32_t)p->cur_interval * 1250);
+    tx_data(buffer, len + 1);
+
+    free(g->samples);
+    g->samples = NULL;
+}
+
+static void ping_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+{
+    conn_info_t *p = conn_infos + get_id_of_handle(channel);
+    struct ping_info *g = &p->ping;
+    gattc_report_begin(channel);
+
+    switch (packet[0])
+    {
+    case GATT_EVENT_QUERY_COMPLETE:
+        {
+            const gatt_event_query_complete_t *complete = gatt_event_query_complete_parse(packet);
+            if (NULL == g->samples) break;
+
+            if (0 == complete->status)
+                g->samples[g->done++] = (uint32_t)(platform_get_us_time() - g->sent_time);
+
+            if ((complete->status != 0) || (g->done >= g->count))
+            {
+                ping_report(p, complete->status);
+                gattc_done(p, complete->status);
+            }
+            else
+                btstack_push_user_runnable(stack_ping_next, NULL, p - conn_infos);
+        }
+        break;
+    }
+    gattc_report_end();
+}
+
+static void stack_ping_next(void *user_data, uint16_t id)
+{
+    conn_info_t *p = conn_infos + id;
+    gattc_op_t *op = p->gattc.first;
+    uint8_t r;
+
+    if ((NULL == op) || (op->type != GATTC_OP_PING) || (NULL == p->ping.samples))
+        return;
+
+    r = ping_send(p, op->value_handle);
+    if (r)
+    {
+        stack_tag = op->tag;
+        ping_report(p, r);
+        stack_tag = NO_TAG;
+        gattc_done(p, r);
+    }
+}
+
+// the time is taken on the device, so UART latency is not included
+static uint8_t ping_send(conn_info_t *p, uint16_t value_handle)
+{
+    p->ping.sent_time = platform_get_us_time();
+    return gatt_client_read_value_of_characteristic_using_value_handle(
+                ping_callback,
+                p->handle,
+                value_handle);
+}
+
+static uint8_t ping_start(conn_info_t *p, const gattc_op_t *op)
+{
+    struct ping_info *g = &p->ping;
+    uint8_t r;
+
+    memcpy(&g->count, op->data, sizeof(g->count));
+    g->done = 0;
+    g->samples = (uint32_t *)at_alloc(g->count * sizeof(g->samples[0]));
+
+    r = ping_send(p, op->value_handle);
+    if (r)
+    {
+        free(g->samples);
+        g->samples = NULL;
+    }
+    return r;
+}
+
+static uint8_t gattc_start(conn_info_t *p, gattc_op_t *op)
+{
+    uint8_t r;
+    switch (op->type)
+    {
+    case GATTC_OP_DISCOVER:
+        p->discoverer = gatt_client_util_discover_all(p->handle, gatt_client_dump_profile, p);
+        return p->discoverer ? 0 : BTSTACK_MEMORY_ALLOC_FAILED;
+    case GATTC_OP_READ:
+        return gatt_client_read_value_of_characteristic_using_value_handle(
+                read_characteristic_value_callback,
+                p->handle,
+                op->value_handle);
+    case GATTC_OP_READ_LONG:
+        p->client_long.value_handle = op->value_handle;
+        p->client_long.len = 0;
+        p->client_long.data = (uint8_t *)at_alloc(MAX_LONG_VALUE_SIZE);
+        r = gatt_client_read_long_value_of_characteristic_using_value_handle(
+                read_long_value_callback,
+                p->handle,
+                op->value_handle);
+        if (r) free_long_value(&p->client_long);
+        return r;
+    case GATTC_OP_READ_MULTI:
+        memcpy(p->read_multi_handles, op->data, op->len);
+        return gatt_client_read_multiple_characteristic_values(
+                read_multiple_values_callback,
+                p->handle,
+                op->len / sizeof(uint16_t),
+                p->read_multi_handles);
+    case GATTC_OP_WRITE:
+        return gatt_client_write_value_of_characteristic(
+                write_characteristic_value_callback,
+                p->handle,
+                op->value_handle,
+                op->len,
+                op->data);
+    case GATTC_OP_WRITE_LONG:
+        return gatt_client_write_long_value_of_characteristic(
+                write_long_value_callback,
+                p->handle,
+                op->value_handle,
+                op->len,
+                op->data);
+    case GATTC_OP_SUB:
+        return gattc_sub(p, op);
+    case GATTC_OP_PING:
+        return ping_start(p, op);
+    default:
+        return BTSTACK_MEMORY_ALLOC_FAILED;
+    }
+}
+
+// an operation that can't be started completes with the error at once
+static void gattc_report_start_error(conn_info_t *p, const gattc_op_t *op, uint8_t status)
+{
+    static const char *const names[] =
+    {
+        [GATTC_OP_DISCOVER]     = "+BLEGATTCC",
+        [GATTC_OP_READ]         = "+BLEGATTCRD",
+        [GATTC_OP_READ_LONG]    = "+BLEGATTCRDL",
+        [GATTC_OP_READ_MULTI]   = "+BLEGATTCRDM",
+        [GATTC_OP_WRITE]        = "+BLEGATTCWR",
+        [GATTC_OP_WRITE_LONG]   = "+BLEGATTCWRL",
+        [GATTC_OP_SUB]          = "+BLEGATTCSUB",
+        [GATTC_OP_PING]         = "+BLEPING",
+    };
+    int id = p - conn_infos;
+    int len;
+    if ((op->type == GATTC_OP_DISCOVER) || (op->type == GATTC_OP_READ_MULTI) || (op->type == GATTC_OP_PING))
+        len = sprintf(buffer, "%s:%d,%d\n", names[op->type], id, status);
+    else
+        len = sprintf(buffer, "%s:%d,%d,%d\n", names[op->type], id, op->value_handle, status);
+    tx_data(buffer, len + 1);
+}
+
+// Start operations of the link one by one, until one is in progress.
+static void gattc_run(conn_info_t *p)
+{
+    struct gattc_queue *q = &p->gattc;
+    int16_t tag = stack_tag;
+
+    while (q->first && !q->busy)
+    {
+        gattc_op_t *op = q->first;
+        uint8_t r;
+
+        stack_tag = op->tag;
+        r = gattc_start(p, op);
+        if (0 == r)
+        {
+            q->busy = 1;
+            break;
+        }
+
+        gattc_report_start_error(p, op, r);
+        p->lq.errors++;
+        q->first = op->next;
+        q->num--;
+        free(op);
+    }
+
+    stack_tag = tag;
+}
+
+static void wrnr_pump(conn_info_t *p);
+static void tput_pump(conn_info_t *p);
+
+static void stack_gattc_next(void *user_data, uint16_t id)
+{
+    conn_info_t *p = conn_infos + id;
+    gattc_run(p);
+
+    // writes without response are held while an operation is in progress
+    if (p->gattc.busy) return;
+    if (p->wrnr.first) wrnr_pump(p);
+    if (p->tput_tx.mode == TPUT_WRITE) tput_pump(p);
+}
+
+// The operation in progress is completed: start the next one (or resume
+// writes without response) after the callback returns.
+static void gattc_done(conn_info_t *p, uint8_t status)
+{
+    struct gattc_queue *q = &p->gattc;
+    gattc_op_t *op = q->first;
+
+    if ((NULL == op) || (0 == q->busy)) return;
+
+    if (status) p->lq.errors++;
+
+    q->first = op->next;
+    q->num--;
+    q->busy = 0;
+    free(op);
+
+    btstack_push_user_runnable(stack_gattc_next, NULL, p - conn_infos);
+}
+
+static void gattc_free(conn_info_t *p)
+{
+    struct gattc_queue *q = &p->gattc;
+    while (q->first)
+    {
+        gattc_op_t *op = q->first;
+        q->first = op->next;
+        free(op);
+    }
+    memset(q, 0, sizeof(*q));
+
+    if (p->ping.samples) free(p->ping.samples);
+    p->ping.samples = NULL;
+}
+
+static void stack_gattc_enqueue(void *user_data, uint16_t id)
+{
+    static const char queue_full[] = "ERROR: QUEUE FULL\n";
+    gattc_op_t *op = (gattc_op_t *)user_data;
+    conn_info_t *p = conn_infos + id;
+    struct gattc_queue *q = &p->gattc;
+
+    if (p->handle == INVALID_HANDLE)
+    {
+        free(op);
+        at_tx_error();
+        return;
+    }
+
+    if (q->num >= gattc_queue_depth)
+    {
+        free(op);
+        tx_data(queue_full, sizeof(queue_full));
+        return;
+    }
+
+    op->next = NULL;
+    if (q->first)
+        q->last->next = op;
+    else
+        q->first = op;
+    q->last = op;
+    q->num++;
+
+    at_tx_ok();
+    gattc_run(p);
+}
+
+// allocated in AT task, so the operation carries the tag of the command
+static gattc_op_t *gattc_op_new(uint8_t type, uint16_t value_handle, uint16_t len)
+{
+    gattc_op_t *op = (gattc_op_t *)at_alloc(sizeof(gattc_op_t) + len);
+    op->type = type;
+    op->tag = cmd_tag;
+    op->value_handle = value_handle;
+    op->desc_handle = 0;
+    op->len = len;
+    return op;
+}
+
+static void get_ble_gattc_queue(void)
+{
+    int len = sprintf(buffer, "+BLEGATTCQ:%d\n", gattc_queue_depth);
+    tx_data(buffer, len + 1);
+}
+
+static void set_ble_gattc_queue(int argc, const char *argv[])
+{
+    if (argc < 1) goto error;
+
+    int depth = atoi(argv[0]);
+    if ((depth < 1) || (depth > MAX_GATTC_QUEUE_DEPTH)) goto error;
+
+    gattc_queue_depth = (uint8_t)depth;
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void set_ble_gattc(int argc, const char *argv[])
+{
+    if (argc < 1) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    at_push_runnable(stack_gattc_enqueue, gattc_op_new(GATTC_OP_DISCOVER, 0, 0), id);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void set_ble_gattc_read(int argc, const char *argv[])
+{
+    if (argc < 2) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    at_push_runnable(stack_gattc_enqueue,
+        gattc_op_new(GATTC_OP_READ, (uint16_t)atoi(argv[1]), 0), id);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void set_ble_gattc_read_long(int argc, const char *argv[])
+{
+    if (argc < 2) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    at_push_runnable(stack_gattc_enqueue,
+        gattc_op_new(GATTC_OP_READ_LONG, (uint16_t)atoi(argv[1]), 0), id);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void set_ble_gattc_write_long(int argc, const char *argv[])
+{
+    if (argc < 3) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    int len = strlen(argv[2]) / 2;
+    if ((len < 1) || (len > MAX_LONG_VALUE_SIZE)) goto error;
+
+    gattc_op_t *op = gattc_op_new(GATTC_OP_WRITE_LONG, (uint16_t)atoi(argv[1]), len);
+    op->len = (uint16_t)load_hex_data(argv[2], op->data);
+
+    at_push_runnable(stack_gattc_enqueue, op, id);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void set_ble_gattc_read_multi(int argc, const char *argv[])
+{
+    int i;
+    if (argc < 3) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    gattc_op_t *op = gattc_op_new(GATTC_OP_READ_MULTI, 0, (argc - 1) * sizeof(uint16_t));
+    for (i = 1; i < argc; i++)
+    {
+        uint16_t handle = (uint16_t)atoi(argv[i]);
+        memcpy(op->data + (i - 1) * sizeof(uint16_t), &handle, sizeof(handle));
+    }
+
+    at_push_runnable(stack_gattc_enqueue, op, id);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void set_ble_gattc_write(int argc, const char *argv[])
+{
+    if (argc < 3) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    gattc_op_t *op = gattc_op_new(GATTC_OP_WRITE, (uint16_t)atoi(argv[1]), strlen(argv[2]) / 2);
+    op->len = (uint16_t)load_hex_data(argv[2], op->data);
+
+    at_push_runnable(stack_gattc_enqueue, op, id);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void set_ble_ping(int argc, const char *argv[])
+{
+    if (argc < 1) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    int count = argc >= 2 ? atoi(argv[1]) : 10;
+    if ((count < 1) || (count > MAX_PING_COUNT)) goto error;
+
+    uint16_t value_handle = argc >= 3 ? (uint16_t)atoi(argv[2]) : 1;
+    uint16_t n = (uint16_t)count;
+
+    gattc_op_t *op = gattc_op_new(GATTC_OP_PING, value_handle, sizeof(n));
+    memcpy(op->data, &n, sizeof(n));
+
+    at_push_runnable(stack_gattc_enqueue, op, id);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+static void wrnr_free(conn_info_t *p);
+
+static void wrnr_can_write_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+{
+    switch (packet[0])
+    {
+    case GATT_EVENT_CAN_WRITE_WITHOUT_RESPONSE:
+        {
+            conn_info_t *p = conn_infos + get_id_of_handle(channel);
+            p->wrnr.waiting = 0;
+            wrnr_pump(p);
+        }
+        break;
+    }
+}
+
+// status: 0 if all queued data is sent, or error code of the stack
+static void wrnr_report(conn_info_t *p, int status)
+{
+    struct wrnr_info *w = &p->wrnr;
+    uint64_t elapsed = platform_get_us_time() - w->start_time;
+    uint32_t rate = elapsed > 0 ? (uint32_t)((uint64_t)w->total * 1000000 / elapsed) : 0;
+    int len = sprintf(buffer, "+BLEGATTCWRNR:%d,%u,%u,%u,%d\n", (int)(p - conn_infos),
+                      w->total, (uint32_t)(elapsed / 1000), rate, status);
+    int16_t tag = stack_tag;
+    stack_tag = w->tag;
+    tx_data(buffer, len + 1);
+    stack_tag = tag;
+}
+
+// Send queued data as long as the stack has buffers for the link. When
+// the stack runs out of buffers, wait for it to tell us to continue; on
+// any other error, the rest of the queue is dropped. While an operation of
+// the GATT client queue is in progress, sending is held and resumed by
+// stack_gattc_next.
+static void wrnr_pump(conn_info_t *p)
+{
+    struct wrnr_info *w = &p->wrnr;
+    uint16_t mtu = ATT_DEFAULT_MTU;
+
+    if (w->waiting || p->gattc.busy) return;
+
+    gatt_client_get_mtu(p->handle, &mtu);
+
+    while (w->first)
+    {
+        wrnr_chunk_t *c = w->first;
+        uint16_t len = c->len - w->sent;
+        int r;
+        if (len > mtu - 3) len = mtu - 3;
+
+        r = gatt_client_write_value_of_characteristic_without_response(p->handle,
+                c->value_handle, len, c->data + w->sent);
+        if (BTSTACK_ACL_BUFFERS_FULL == r)
+        {
+            w->waiting = 1;
+            gatt_client_request_can_write_without_response_event(wrnr_can_write_callback, p->handle);
+            return;
+        }
+        if (r != 0)
+        {
+            wrnr_report(p, r);
+            wrnr_free(p);
+            return;
+        }
+
+        w->sent += len;
+        w->total += len;
+        if (w->sent >= c->len)
+        {
+            w->first = c->next;
+            w->queued -= c->len;
+            w->sent = 0;
+            free(c);
+        }
+    }
+
+    w->last = NULL;
+    wrnr_report(p, 0);
+}
+
+static void wrnr_free(conn_info_t *p)
+{
+    struct wrnr_info *w = &p->wrnr;
+    while (w->first)
+    {
+        wrnr_chunk_t *c = w->first;
+        w->first = c->next;
+        free(c);
+    }
+    memset(w, 0, sizeof(*w));
+}
+
+static void stack_write_char_nr(void *user_data, uint16_t id)
+{
+    wrnr_chunk_t *c = (wrnr_chunk_t *)user_data;
+    conn_info_t *p = conn_infos + id;
+    struct wrnr_info *w = &p->wrnr;
+
+    if (   (p->handle == INVALID_HANDLE) || (w->queued + c->len > MAX_WRNR_QUEUE_SIZE)
+        || (p->tput_tx.mode == TPUT_WRITE))
+    {
+        free(c);
+        at_tx_error();
+        return;
+    }
+
+    c->next = NULL;
+    w->queued += c->len;
+    if (w->first)
+        w->last->next = c;
+    else
+    {
+        w->first = c;
+        w->total = 0;
+        w->start_time = platform_get_us_time();
+    }
+    w->last = c;
+
+    w->tag = stack_tag;
+    at_tx_ok();
+    wrnr_pump(p);
+}
+
+static void set_ble_gattc_write_nr(int argc, const char *argv[])
+{
+    if (argc < 3) goto error;
+
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    int len = strlen(argv[2]) / 2;
+    if ((len < 1) || (len > MAX_WRNR_QUEUE_SIZE)) goto error;
+
+    wrnr_chunk_t *c = (wrnr_chunk_t *)at_alloc(sizeof(wrnr_chunk_t) + len);
+    c->value_handle = (uint16_t)atoi(argv[1]);
+    c->len = (uint16_t)load_hex_data(argv[2], c->data);
+
+    at_push_runnable(stack_write_char_nr, c, id);
+    return;
+
+error:
+    at_tx_error();
+    return;
+}
+
+// Link throughput test: data is generated and counted on the device, only
+// the summary goes through UART.
+static uint8_t tput_data[MAX_TPUT_PACKET_SIZE];
+
+// status: 0 if completed, TPUT_ABORTED, error code of the stack, or reason of disconnection
+static void tput_report(conn_info_t *p, int status)
+{
+    struct tput_info *t = &p->tput_tx;
+    uint64_t elapsed = platform_get_us_time() - t->start_time;
+    uint32_t rate = elapsed > 0 ? (uint32_t)((uint64_t)t->bytes * 1000000 / elapsed) : 0;
+    int16_t tag = stack_tag;
+    int len = sprintf(buffer, "+BLETPUT:%d,%d,%u,%u,%u,%u,%u\n", (int)(p - conn_infos), status,
+                      t->bytes, t->packets, t->stalls, (uint32_t)(elapsed / 1000), rate);
+    stack_tag = t->tag;
+    tx_data(buffer, len + 1);
+    stack_tag = tag;
+    t->mode = TPUT_NONE;
+}
+
+static void tput_rx_report(conn_info_t *p)
+{
+    struct tput_info *t = &p->tput_rx;
+    uint64_t elapsed = t->packets ? platform_get_us_time() - t->start_time : 0;
+    uint32_t rate = elapsed > 0 ? (uint32_t)((uint64_t)t->bytes * 1000000 / elapsed) : 0;
+    int16_t tag = stack_tag;
+    int len = sprintf(buffer, "+BLETPUTRX:%d,%u,%u,%u,%u,%u\n", (int)(p - conn_infos),
+                      t->bytes, t->packets, t->stalls, (uint32_t)(elapsed / 1000), rate);
+    stack_tag = t->tag;
+    tx_data(buffer, len + 1);
+    stack_tag = tag;
+    t->mode = TPUT_NONE;
+}
+
+static void tput_can_write_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+{
+    switch (packet[0])
+    {
+    case GATT_EVENT_CAN_WRITE_WITHOUT_RESPONSE:
+        {
+            conn_info_t *p = conn_infos + get_id_of_handle(channel);
+            p->tput_tx.waiting = 0;
+            tput_pump(p);
+        }
+        break;
+    }
+}
+
+// Send as fast as the stack has buffers; each packet starts with its
+// sequence number, so that a sink can check the order. Errors other than
+// running out of buffers end the test. Like AT+BLEGATTCWRNR, write mode is
+// held while an operation of the GATT client queue is in progress.
+static void tput_pump(conn_info_t *p)
+{
+    struct tput_info *t = &p->tput_tx;
+
+    if ((t->mode == TPUT_WRITE) && p->gattc.busy) return;
+
+    while ((t->mode != TPUT_NONE) && !t->waiting && (t->bytes < t->target))
+    {
+        uint16_t len = t->target - t->bytes < t->size ? (uint16_t)(t->target - t->bytes) : t->size;
+        int r;
+
+        memcpy(tput_data, &t->packets, len < sizeof(t->packets) ? len : sizeof(t->packets));
+        if (t->mode == TPUT_NOTIFY)
+            r = att_server_notify(p->handle, t->value_handle, tput_data, len);
+        else
+            r = gatt_client_write_value_of_characteristic_without_response(p->handle,
+                    t->value_handle, len, tput_data);
+
+        if ((r != 0) && (r != BTSTACK_ACL_BUFFERS_FULL))
+        {
+            tput_report(p, r);
+            return;
+        }
+        if (r != 0)
+        {
+            t->stalls++;
+            t->waiting = 1;
+            if (t->mode == TPUT_NOTIFY)
+                att_server_request_can_send_now_event(p->handle);
+            else
+                gatt_client_request_can_write_without_response_event(tput_can_write_callback, p->handle);
+            return;
+        }
+
+        t->bytes += len;
+        t->packets++;
+    }
+
+    if ((t->mode != TPUT_NONE) && (t->bytes >= t->target))
+        tput_report(p, 0);
+}
+
+void at_on_can_send_now(void)
+{
+    int i;
+    for (i = 0; i < TOTAL_CONN_NUM; i++)
+    {
+        conn_info_t *p = conn_infos + i;
+        if ((p->tput_tx.mode != TPUT_NOTIFY) || !p->tput_tx.waiting) continue;
+        p->tput_tx.waiting = 0;
+        tput_pump(p);
+    }
+}
+
+// returns non-zero if the value is consumed by the sink
+static int tput_rx_data(conn_info_t *p, uint16_t value_handle, const uint8_t *value, uint16_t len)
+{
+    struct tput_info *t = &p->tput_rx;
+    uint32_t seq = 0;
+
+    if ((t->mode == TPUT_NONE) || (t->value_handle != value_handle))
+        return 0;
+
+    if (0 == t->packets)
+        t->start_time = platform_get_us_time();
+
+    // packets not following the previous one (from AT+BLETPUT of a peer):
+    // a lost packet is counted once, not for every packet after it
+    memcpy(&seq, value, len < sizeof(seq) ? len : sizeof(seq));
+    if (len >= sizeof(seq))
+    {
+        if (seq != t->next_seq)
+            t->stalls++;
+        t->next_seq = seq + 1;
+    }
+
+    t->bytes += len;
+    t->packets++;
+    if (t->target && (t->bytes >= t->target))
+        tput_rx_report(p);
+    return 1;
+}
+
+static void stack_tput_start(void *user_data, uint16_t id)
+{
+    struct tput_info *param = (struct tput_info *)user_data;
+    conn_info_t *p = conn_infos + id;
+    struct tput_info *t = param->mode == TPUT_SINK ? &p->tput_rx : &p->tput_tx;
+    uint16_t mtu = ATT_DEFAULT_MTU;
+
+    // write mode shares the can-write-without-response request with
+    // AT+BLEGATTCWRNR, which can't be used at the same time
+    if (   (p->handle == INVALID_HANDLE) || (t->mode != TPUT_NONE)
+        || ((param->mode == TPUT_WRITE) && (p->wrnr.first || p->wrnr.waiting)))
+    {
+        free(param);
+        at_tx_error();
+        return;
+    }
+
+    *t = *param;
+    free(param);
+    t->tag = stack_tag;
+    t->start_time = platform_get_us_time();
+
+    gatt_client_get_mtu(p->handle, &mtu);
+    if (t->size > mtu - 3) t->size = mtu - 3;
+
+    at_tx_ok();
+    if (t->mode != TPUT_SINK)
+        tput_pump(p);
 }
 
-static void stack_discover_all(void *p, uint16_t value)
+static void stack_tput_stop(void *user_data, uint16_t id)
 {
-    conn_info_t *conn = (conn_info_t *)p;
-    conn->discoverer = gatt_client_util_discover_all(value, gatt_client_dump_profile, p);
+    conn_info_t *p = conn_infos + id;
+    uintptr_t sink = (uintptr_t)user_data;
+
+    at_tx_ok();
+    if (sink)
+    {
+        if (p->tput_rx.mode != TPUT_NONE) tput_rx_report(p);
+    }
+    else
+    {
+        if (p->tput_tx.mode != TPUT_NONE) tput_report(p, TPUT_ABORTED);
+    }
 }
 
-static void set_ble_gattc(int argc, const char *argv[])
+static void set_ble_tput(int argc, const char *argv[])
 {
-    if (argc < 1) goto error;
+    if (argc < 4) goto error;
 
     int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
     conn_info_t *p = conn_infos + id;
     if (p->handle == INVALID_HANDLE) goto error;
 
-    if (p->discoverer) goto error;
+    uint32_t bytes = (uint32_t)atoi(argv[2]);
+    if (0 == bytes)
+    {
+        at_push_runnable(stack_tput_stop, (void *)0, id);
+        return;
+    }
 
-    btstack_push_user_runnable(stack_discover_all, p, p->handle);
+    int size = atoi(argv[3]);
+    int mode = argc >= 5 ? atoi(argv[4]) : 0;
+    if ((size < 1) || (size > MAX_TPUT_PACKET_SIZE) || (mode < 0) || (mode > 1)) goto error;
 
-    at_tx_ok();
+    struct tput_info *t = (struct tput_info *)at_alloc(sizeof(struct tput_info));
+    memset(t, 0, sizeof(*t));
+    t->mode = mode == 0 ? TPUT_NOTIFY : TPUT_WRITE;
+    t->value_handle = (uint16_t)atoi(argv[1]);
+    t->size = (uint16_t)size;
+    t->target = bytes;
+
+    at_push_runnable(stack_tput_start, t, id);
     return;
 
 error:
@@ -874,58 +3845,77 @@ error:
     return;
 }
 
-void read_characteristic_value_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+static void set_ble_tput_rx(int argc, const char *argv[])
 {
-    switch (packet[0])
-    {
-    case GATT_EVENT_CHARACTERISTIC_VALUE_QUERY_RESULT:
-        {
-            uint16_t value_size;
-            const gatt_event_value_packet_t *value =
-                gatt_event_characteristic_value_query_result_parse(packet, size, &value_size);
+    if (argc < 2) goto error;
 
-            char *s = buffer + sprintf(buffer, "+BLEGATTCRD:%d,%d,0,", get_id_of_handle(channel), value->handle);
-            s = append_hex_str(s, value->value, value_size);
-            strcpy(s, "\n");
-            tx_data(buffer, s - buffer + 2);
-        }
-        break;
-    case GATT_EVENT_QUERY_COMPLETE:
-        {
-            const gatt_event_query_complete_t *complete = gatt_event_query_complete_parse(packet);
-            if (complete->status != 0)
-            {
-                int len = sprintf(buffer, "+BLEGATTCRD:%d,%d,%d\n", get_id_of_handle(channel), complete->handle, complete->status);
-                tx_data(buffer, len + 1);
-            }
-            else;
-        }
-        break;
+    int id = atoi(argv[0]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
+    conn_info_t *p = conn_infos + id;
+    if (p->handle == INVALID_HANDLE) goto error;
+
+    uint16_t value_handle = (uint16_t)atoi(argv[1]);
+    if (0 == value_handle)
+    {
+        at_push_runnable(stack_tput_stop, (void *)1, id);
+        return;
     }
-}
 
-static void stack_read_char(void *p, uint16_t value_handle)
-{
-    uint8_t r = gatt_client_read_value_of_characteristic_using_value_handle(
-                read_characteristic_value_callback,
-                (uint16_t)(uintptr_t)p,
-                value_handle);
-    if (0 == r)
-        at_tx_ok();
-    else
-        at_tx_error();
+    struct tput_info *t = (struct tput_info *)at_alloc(sizeof(struct tput_info));
+    memset(t, 0, sizeof(*t));
+    t->mode = TPUT_SINK;
+    t->value_handle = value_handle;
+    t->target = argc >= 3 ? (uint32_t)atoi(argv[2]) : 0;
+
+    at_push_runnable(stack_tput_start, t, id);
+    return;
+
+error:
+    at_tx_error();
+    return;
 }
 
-static void set_ble_gattc_read(int argc, const char *argv[])
+static void set_ble_gattc_sub(int argc, const char *argv[])
 {
-    if (argc < 2) goto error;
+    if (argc < 3) goto error;
 
     int id = atoi(argv[0]);
-    uint16_t handle = (uint16_t)atoi(argv[1]);
+    if ((id < 0) || (id >= TOTAL_CONN_NUM)) goto error;
     conn_info_t *p = conn_infos + id;
     if (p->handle == INVALID_HANDLE) goto error;
 
-    btstack_push_user_runnable(stack_read_char, (void *)(uintptr_t)p->handle, handle);
+    uint16_t value_handle = (uint16_t)atoi(argv[1]);
+
+    notification_handler_t *first = p->first_handler;
+
+    while (first)
+    {
+        if (first->value_handle == value_handle) break;
+        first = first->next;
+    }
+
+    if (NULL == first)
+    {
+        first = (notification_handler_t *)at_alloc(sizeof(notification_handler_t));
+        first->next = p->first_handler;
+        p->first_handler = first;
+
+        first->registered = 0;
+        first->value_handle = value_handle;
+        if (argc < 4)
+            first->desc_handle = value_handle + 1;
+    }
+
+    if (argc >= 4)
+        first->desc_handle = (uint16_t)atoi(argv[3]);
+
+    first->config = (uint16_t)atoi(argv[2]);
+
+    gattc_op_t *op = gattc_op_new(GATTC_OP_SUB, value_handle, sizeof(first->config));
+    op->desc_handle = first->desc_handle;
+    memcpy(op->data, &first->config, sizeof(first->config));
+
+    at_push_runnable(stack_gattc_enqueue, op, id);
     return;
 
 error:
@@ -933,51 +3923,61 @@ error:
     return;
 }
 
-void write_characteristic_value_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+static void stack_set_sec_param(void *user_data, uint16_t value)
 {
-    switch (packet[0])
-    {
-    case GATT_EVENT_QUERY_COMPLETE:
-        {
-            const gatt_event_query_complete_t *complete = gatt_event_query_complete_parse(packet);
-            int len = sprintf(buffer, "+BLEGATTCWR:%d,%d,%d\n", get_id_of_handle(channel), complete->handle, complete->status);
-            tx_data(buffer, len + 1);
-        }
-        break;
-    }
+    uintptr_t v = (uintptr_t)user_data;
+    sm_config(v & 0xff, (v >> 8) & 0xff, 0, &sm_persistent);
+    sm_set_authentication_requirements(sec_auth_req);
 }
 
-static void stack_write_char(void *user_data, uint16_t value_len)
+static void set_ble_sec_param(int argc, const char *argv[])
 {
-    conn_info_t *p = (conn_info_t *)user_data;
+    if (argc < 3) goto error;
 
-    uint8_t r = gatt_client_write_value_of_characteristic(
-                write_characteristic_value_callback,
-                p->handle,
-                p->write_char_info.value_handle,
-                value_len,
-                p->write_char_info.data);
-    if (0 == r)
-        at_tx_ok();
-    else
-        at_tx_error();
+    uint32_t enable = (uint8_t)atoi(argv[0]);
+    sec_auth_req = (uint8_t)atoi(argv[1]);
+    uint32_t io_cap = (uint8_t)atoi(argv[2]);
+    sec_enable = enable;
+    sec_io_cap = io_cap;
+
+    uintptr_t v = (io_cap << 8) | enable;
+
+    at_push_runnable(stack_set_sec_param, (void *)v, 0);
+
+    at_tx_ok();
+    return;
+
+error:
+    at_tx_error();
+    return;
 }
 
-static void set_ble_gattc_write(int argc, const char *argv[])
+static void reset_all(void)
 {
-    if (argc < 3) goto error;
+    kv_remove_all();
+    kv_commit(1);
+    platform_reset();
+}
 
-    uint8_t id = (uint8_t)atoi(argv[0]);
+static uint8_t power_saving = 0;
 
-    conn_info_t *p = conn_infos + id;
-    if (p->handle == INVALID_HANDLE) goto error;
+static void get_power_saving(void)
+{
+    uint32_t last, max;
+    uart_wake_get_latency(&last, &max);
+    int len = sprintf(buffer, "+POWERSAVING:%d,%u,%u\n", power_saving, last, max);
+    tx_data(buffer, len + 1);
+    at_tx_ok();
+}
 
-    p->write_char_info.value_handle = (uint16_t)atoi(argv[1]);
-    p->write_char_info.data = (uint8_t *)argv[2];
-    uint16_t len = (uint16_t)load_hex_data(argv[2], (uint8_t *)argv[2]);
+static void set_power_saving(int argc, const char *argv[])
+{
+    if (argc < 1) goto error;
 
-    btstack_push_user_runnable(stack_write_char, p, len);
+    power_saving = (uint8_t)atoi(argv[0]);
+    platform_config(PLATFORM_CFG_POWER_SAVING, power_saving);
 
+    at_tx_ok();
     return;
 
 error:
@@ -985,112 +3985,380 @@ error:
     return;
 }
 
-static void output_notification_handler(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+// AT+SAVE: configuration saved into kv storage, and applied at boot.
+// Bump the version when anything saved here changes its layout.
+#define SAVED_CONFIG_VERSION        4
+
+// delay before committing, so that consecutive AT+SAVE are written once
+#define SAVED_CONFIG_COMMIT_DELAY   (1600 / 2)  // 500ms
+
+// fields are copied one by one, so that the saved layout does not depend
+// on SDK types (enums) or on the runtime structs
+struct saved_link
 {
-    const gatt_event_value_packet_t *value;
-    uint16_t value_size = 0;
-    int len = 0;
-    switch (packet[0])
+    uint16_t min_interval, max_interval, latency, timeout;
+    uint8_t peer_addr_type;
+    bd_addr_t peer_addr;
+    uint8_t tx_phys, rx_phys, phy_opt;
+};
+
+struct saved_adv_param
+{
+    uint8_t advertising;
+    uint32_t adv_int_min, adv_int_max;
+    uint8_t adv_type;
+    uint8_t own_addr_type;
+    uint8_t channel_map;
+    uint8_t adv_filter_policy;
+    uint8_t peer_addr_type;
+    bd_addr_t peer_addr;
+    int8_t tx_power;
+};
+
+struct saved_scan_param
+{
+    uint8_t scan_type;
+    uint8_t own_addr_type;
+    uint8_t filter_policy;
+    uint16_t scan_interval, scan_window;
+    uint8_t scanning;
+    uint16_t interval;
+    uint8_t filter_type;
+    bd_addr_t filter_addr;
+    uint8_t phys;
+    uint16_t interval_1m, window_1m;
+    uint16_t interval_coded, window_coded;
+};
+
+struct saved_adv_set
+{
+    uint8_t configured;
+    uint8_t advertising;
+    uint32_t adv_int_min, adv_int_max;
+    uint16_t adv_type;
+    uint8_t own_addr_type;
+    uint8_t channel_map;
+    uint8_t adv_filter_policy;
+    uint8_t peer_addr_type;
+    bd_addr_t peer_addr;
+    int8_t tx_power;
+    uint8_t primary_phy, secondary_phy, sid;
+    uint16_t duration;
+    uint8_t max_events;
+    uint8_t per_advertising;
+    uint16_t per_int_min, per_int_max, per_properties;
+};
+
+struct saved_config
+{
+    uint8_t version;
+    bd_addr_t identity_addr;
+    uint8_t sec_enable, sec_auth_req, sec_io_cap;
+    uint16_t initiating_timeout;
+    uint8_t adv_data_len, scan_data_len;
+    uint8_t adv_data[31], scan_data[31];
+    struct saved_adv_param adv_param;
+    struct saved_scan_param scan_param;
+    struct saved_link links[MAX_CONN_AS_MASTER];
+    struct saved_adv_set adv_sets[MAX_ADV_SET_NUM - 1];
+};
+
+// data of advertising sets is saved under keys of its own, as it may be long
+#define adv_set_data_key(id, type)  (KV_KEY_ADV_SET_DATA + ((id) - 1) * ADV_DATA_NUM + (type))
+
+static void save_adv_scan_param(struct saved_config *config)
+{
+    struct saved_adv_param *a = &config->adv_param;
+    struct saved_scan_param *c = &config->scan_param;
+
+    a->advertising          = adv_param.advertising;
+    a->adv_int_min          = adv_param.adv_int_min;
+    a->adv_int_max          = adv_param.adv_int_max;
+    a->adv_type             = adv_param.adv_type;
+    a->own_addr_type        = adv_param.own_addr_type;
+    a->channel_map          = adv_param.channel_map;
+    a->adv_filter_policy    = adv_param.adv_filter_policy;
+    a->peer_addr_type       = adv_param.peer_addr_type;
+    memcpy(a->peer_addr, adv_param.peer_addr, sizeof(a->peer_addr));
+    a->tx_power             = adv_param.tx_power;
+
+    c->scan_type            = (uint8_t)scan_param.scan_type;
+    c->own_addr_type        = (uint8_t)scan_param.own_addr_type;
+    c->filter_policy        = (uint8_t)scan_param.filter_policy;
+    c->scan_interval        = scan_param.scan_interval;
+    c->scan_window          = scan_param.scan_window;
+    c->scanning             = scan_param.scanning;
+    c->interval             = scan_param.interval;
+    c->filter_type          = scan_param.filter_type;
+    memcpy(c->filter_addr, scan_param.filter_addr, sizeof(c->filter_addr));
+    c->phys                 = scan_param.phys;
+    c->interval_1m          = scan_param.interval_1m;
+    c->window_1m            = scan_param.window_1m;
+    c->interval_coded       = scan_param.interval_coded;
+    c->window_coded         = scan_param.window_coded;
+}
+
+static void load_adv_scan_param(const struct saved_config *config)
+{
+    const struct saved_adv_param *a = &config->adv_param;
+    const struct saved_scan_param *c = &config->scan_param;
+
+    adv_param.advertising       = a->advertising;
+    adv_param.adv_int_min       = a->adv_int_min;
+    adv_param.adv_int_max       = a->adv_int_max;
+    adv_param.adv_type          = a->adv_type;
+    adv_param.own_addr_type     = a->own_addr_type;
+    adv_param.channel_map       = a->channel_map;
+    adv_param.adv_filter_policy = a->adv_filter_policy;
+    adv_param.peer_addr_type    = a->peer_addr_type;
+    memcpy(adv_param.peer_addr, a->peer_addr, sizeof(adv_param.peer_addr));
+    adv_param.tx_power          = a->tx_power;
+
+    scan_param.scan_type        = (scan_type_t)c->scan_type;
+    scan_param.own_addr_type    = (bd_addr_type_t)c->own_addr_type;
+    scan_param.filter_policy    = (scan_filter_policy_t)c->filter_policy;
+    scan_param.scan_interval    = c->scan_interval;
+    scan_param.scan_window      = c->scan_window;
+    scan_param.scanning         = c->scanning;
+    scan_param.interval         = c->interval;
+    scan_param.filter_type      = c->filter_type;
+    memcpy(scan_param.filter_addr, c->filter_addr, sizeof(scan_param.filter_addr));
+    scan_param.phys             = c->phys;
+    scan_param.interval_1m      = c->interval_1m;
+    scan_param.window_1m        = c->window_1m;
+    scan_param.interval_coded   = c->interval_coded;
+    scan_param.window_coded     = c->window_coded;
+}
+
+static void save_adv_sets(struct saved_config *config)
+{
+    int i, type;
+    for (i = 1; i < MAX_ADV_SET_NUM; i++)
     {
-    case GATT_EVENT_NOTIFICATION:
-        value = gatt_event_notification_parse(packet, size, &value_size);
-        strcpy(buffer, "+BLEGATTCNOTI");
-        len = 13;
-        break;
-    case GATT_EVENT_INDICATION:
-        value = gatt_event_indication_parse(packet, size, &value_size);
-        strcpy(buffer, "+BLEGATTCIND");
-        len = 12;
-        break;
+        const struct adv_set *set = adv_sets + i;
+        struct saved_adv_set *a = config->adv_sets + i - 1;
+
+        a->configured           = set->configured;
+        a->advertising          = set->advertising;
+        a->adv_int_min          = set->adv_int_min;
+        a->adv_int_max          = set->adv_int_max;
+        a->adv_type             = set->adv_type;
+        a->own_addr_type        = set->own_addr_type;
+        a->channel_map          = set->channel_map;
+        a->adv_filter_policy    = set->adv_filter_policy;
+        a->peer_addr_type       = set->peer_addr_type;
+        memcpy(a->peer_addr, set->peer_addr, sizeof(a->peer_addr));
+        a->tx_power             = set->tx_power;
+        a->primary_phy          = set->primary_phy;
+        a->secondary_phy        = set->secondary_phy;
+        a->sid                  = set->sid;
+        a->duration             = set->en.duration;
+        a->max_events           = set->en.max_events;
+        a->per_advertising      = set->per_advertising;
+        a->per_int_min          = set->per_int_min;
+        a->per_int_max          = set->per_int_max;
+        a->per_properties       = set->per_properties;
+
+        for (type = 0; type < ADV_DATA_NUM; type++)
+        {
+            const adv_data_t *d = set->data[type];
+            if (d && d->len)
+                kv_put(adv_set_data_key(i, type), d->data, d->len);
+            else
+                kv_remove(adv_set_data_key(i, type));
+        }
     }
-    if (value_size < 1) return;
-    char *s = buffer + len;
-    s += sprintf(s, ":%d,%d,", get_id_of_handle(channel), value->handle);
-    s = append_hex_str(s, value->value, value_size);
-    strcpy(s, "\n");
-    tx_data(buffer, s - buffer + 2);
 }
 
-static void write_characteristic_descriptor_callback(uint8_t packet_type, uint16_t channel, const uint8_t *packet, uint16_t size)
+static void remove_adv_set_data(void)
 {
-    switch (packet[0])
+    int i, type;
+    for (i = 1; i < MAX_ADV_SET_NUM; i++)
+        for (type = 0; type < ADV_DATA_NUM; type++)
+            kv_remove(adv_set_data_key(i, type));
+}
+
+// sets and periodic trains are stopped, reconfigured, and started again
+// if they were running when saved
+static void load_adv_sets(const struct saved_config *config)
+{
+    int i, type;
+    for (i = 1; i < MAX_ADV_SET_NUM; i++)
     {
-    case GATT_EVENT_QUERY_COMPLETE:
+        struct adv_set *set = adv_sets + i;
+        const struct saved_adv_set *a = config->adv_sets + i - 1;
+
+        if (set->per_advertising)
         {
-            const gatt_event_query_complete_t *complete = gatt_event_query_complete_parse(packet);
-            int len = sprintf(buffer, "+BLEGATTCSUB:%d,%d,%d\n", get_id_of_handle(channel), complete->handle, complete->status);
-            tx_data(buffer, len + 1);
+            set->per_advertising = 0;
+            stack_per_adv_enable(NULL, i);
+        }
+        if (set->advertising)
+        {
+            set->advertising = 0;
+            stack_adv_set_enable(NULL, i);
+        }
+
+        set->configured         = a->configured;
+        set->adv_int_min        = a->adv_int_min;
+        set->adv_int_max        = a->adv_int_max;
+        set->adv_type           = a->adv_type;
+        set->own_addr_type      = a->own_addr_type;
+        set->channel_map        = a->channel_map;
+        set->adv_filter_policy  = a->adv_filter_policy;
+        set->peer_addr_type     = a->peer_addr_type;
+        memcpy(set->peer_addr, a->peer_addr, sizeof(set->peer_addr));
+        set->tx_power           = a->tx_power;
+        set->primary_phy        = a->primary_phy;
+        set->secondary_phy      = a->secondary_phy;
+        set->sid                = a->sid;
+        set->en.handle          = i;
+        set->en.duration        = a->duration;
+        set->en.max_events      = a->max_events;
+        set->per_int_min        = a->per_int_min;
+        set->per_int_max        = a->per_int_max;
+        set->per_properties     = a->per_properties;
+        if (0 == set->configured) continue;
+
+        stack_adv_set_param(NULL, i);
+        if (set->per_int_min)
+            stack_per_adv_param(NULL, i);
+
+        for (type = 0; type < ADV_DATA_NUM; type++)
+        {
+            int16_t len = 0;
+            const uint8_t *value = kv_get(adv_set_data_key(i, type), &len);
+            adv_data_t *d;
+            if ((NULL == value) || (len <= 0)) continue;
+            d = (adv_data_t *)at_alloc(sizeof(adv_data_t) + len);
+            d->len = len;
+            memcpy(d->data, value, len);
+            if (install_adv_data(i, type, d)) free(d);
+        }
+
+        if (a->advertising)
+        {
+            set->advertising = 1;
+            stack_adv_set_enable(NULL, i);
+        }
+        if (a->per_advertising && set->per_int_min)
+        {
+            set->per_advertising = 1;
+            stack_per_adv_enable(NULL, i);
         }
-        break;
     }
 }
 
-static void stack_sub_char(void *user_data, uint16_t value_handle)
+static void commit_config(void)
 {
-    conn_info_t *p = (conn_info_t *)user_data;
+    kv_commit(1);
+}
 
-    notification_handler_t *first = p->first_handler;
+static void stack_save_config(void *user_data, uint16_t save)
+{
+    struct saved_config config;
+    int i;
 
-    while (first)
+    if (0 == save)
     {
-        if (first->value_handle == value_handle) break;
-        first = first->next;
+        kv_remove(KV_KEY_CONFIG);
+        remove_adv_set_data();
+        platform_set_timer(commit_config, SAVED_CONFIG_COMMIT_DELAY);
+        return;
     }
 
-    if (NULL == first) return;
-
-    if (first->registered == 0)
+    memset(&config, 0, sizeof(config));
+    config.version = SAVED_CONFIG_VERSION;
+    memcpy(config.identity_addr, sm_persistent.identity_addr, sizeof(config.identity_addr));
+    config.sec_enable = sec_enable;
+    config.sec_auth_req = sec_auth_req;
+    config.sec_io_cap = sec_io_cap;
+    config.initiating_timeout = (uint16_t)initiating_timeout;
+    config.adv_data_len = (uint8_t)g_adv_data_len;
+    config.scan_data_len = (uint8_t)g_scan_data_len;
+    memcpy(config.adv_data, g_adv_data, sizeof(config.adv_data));
+    memcpy(config.scan_data, g_scan_data, sizeof(config.scan_data));
+    save_adv_scan_param(&config);
+    save_adv_sets(&config);
+    for (i = 0; i < MAX_CONN_AS_MASTER; i++)
     {
-        gatt_client_listen_for_characteristic_value_updates(
-            &first->notification, output_notification_handler,
-            p->handle, first->value_handle);
-        first->registered = 1;
+        conn_info_t *p = conn_infos + i;
+        config.links[i].min_interval   = p->min_interval;
+        config.links[i].max_interval   = p->max_interval;
+        config.links[i].latency        = p->latency;
+        config.links[i].timeout        = p->timeout;
+        config.links[i].peer_addr_type = (uint8_t)p->peer_addr_type;
+        memcpy(config.links[i].peer_addr, p->peer_addr, sizeof(p->peer_addr));
+        config.links[i].tx_phys        = p->tx_phys;
+        config.links[i].rx_phys        = p->rx_phys;
+        config.links[i].phy_opt        = p->phy_opt;
     }
 
-    gatt_client_write_characteristic_descriptor_using_descriptor_handle(
-        write_characteristic_descriptor_callback,
-        p->handle,
-        first->desc_handle,
-        sizeof(first->config),
-        (uint8_t *)&first->config);
+    kv_put(KV_KEY_CONFIG, (const uint8_t *)&config, sizeof(config));
+    platform_set_timer(commit_config, SAVED_CONFIG_COMMIT_DELAY);
 }
 
-static void set_ble_gattc_sub(int argc, const char *argv[])
+// called in stack context. returns 0 if a saved config is applied
+static int load_config(void)
 {
-    if (argc < 3) goto error;
-
-    uint8_t id = (uint8_t)atoi(argv[0]);
-    conn_info_t *p = conn_infos + id;
-    if (p->handle == INVALID_HANDLE) goto error;
-
-    uint16_t value_handle = (uint16_t)atoi(argv[1]);
-
-    notification_handler_t *first = p->first_handler;
+    int16_t size = 0;
+    int i;
+    const struct saved_config *config = (const struct saved_config *)kv_get(KV_KEY_CONFIG, &size);
+    if ((NULL == config) || (size != sizeof(*config)) || (config->version != SAVED_CONFIG_VERSION))
+        return -1;
 
-    while (first)
+    if (adv_param.advertising)
+        stack_set_ble_adv_stop(NULL, 0);
+    if (scan_param.scanning)
+        stack_scan(NULL, 0);
+
+    memcpy(sm_persistent.identity_addr, config->identity_addr, sizeof(config->identity_addr));
+    update_addr(NULL, 0);
+
+    sec_enable = config->sec_enable;
+    sec_auth_req = config->sec_auth_req;
+    sec_io_cap = config->sec_io_cap;
+    stack_set_sec_param((void *)(uintptr_t)((sec_io_cap << 8) | sec_enable), 0);
+
+    initiating_timeout = config->initiating_timeout;
+    g_adv_data_len = config->adv_data_len;
+    g_scan_data_len = config->scan_data_len;
+    memcpy(g_adv_data, config->adv_data, sizeof(config->adv_data));
+    memcpy(g_scan_data, config->scan_data, sizeof(config->scan_data));
+    load_adv_scan_param(config);
+    for (i = 0; i < MAX_CONN_AS_MASTER; i++)
     {
-        if (first->value_handle == value_handle) break;
-        first = first->next;
+        conn_info_t *p = conn_infos + i;
+        p->min_interval   = config->links[i].min_interval;
+        p->max_interval   = config->links[i].max_interval;
+        p->latency        = config->links[i].latency;
+        p->timeout        = config->links[i].timeout;
+        p->peer_addr_type = (bd_addr_type_t)config->links[i].peer_addr_type;
+        memcpy(p->peer_addr, config->links[i].peer_addr, sizeof(p->peer_addr));
+        p->tx_phys        = config->links[i].tx_phys;
+        p->rx_phys        = config->links[i].rx_phys;
+        p->phy_opt        = config->links[i].phy_opt;
     }
+    load_adv_sets(config);
 
-    if (NULL == first)
-    {
-        first = (notification_handler_t *)at_alloc(sizeof(notification_handler_t));
-        first->next = p->first_handler;
-        p->first_handler = first;
-
-        first->registered = 0;
-        first->value_handle = value_handle;
-        if (argc < 4)
-            first->desc_handle = value_handle + 1;
-    }
+    if (adv_param.advertising)
+        stack_set_ble_adv_start(NULL, 0);
+    if (scan_param.scanning)
+        stack_scan(NULL, 1);
+    return 0;
+}
 
-    if (argc >= 4)
-        first->desc_handle = (uint16_t)atoi(argv[3]);
+static void get_save(void)
+{
+    at_push_runnable(stack_save_config, NULL, 1);
+    at_tx_ok();
+}
 
-    first->config = (uint16_t)atoi(argv[2]);
+static void set_save(int argc, const char *argv[])
+{
+    if ((argc < 1) || (atoi(argv[0]) != 0)) goto error;
 
-    btstack_push_user_runnable(stack_sub_char, p, value_handle);
+    at_push_runnable(stack_save_config, NULL, 0);
 
     at_tx_ok();
     return;
@@ -1100,56 +4368,57 @@ error:
     return;
 }
 
-static void stack_set_sec_param(void *user_data, uint16_t value)
+static void stack_restore_config(void *user_data, uint16_t value)
 {
-    uintptr_t v = (uintptr_t)user_data;
-    sm_config(v & 0xff, (v >> 8) & 0xff, 0, &sm_persistent);
-    sm_set_authentication_requirements(sec_auth_req);
+    if (load_config() == 0)
+        at_tx_ok();
+    else
+        at_tx_error();
 }
 
-static void set_ble_sec_param(int argc, const char *argv[])
+static void get_restore(void)
 {
-    if (argc < 3) goto error;
-
-    uint32_t enable = (uint8_t)atoi(argv[0]);
-    sec_auth_req = (uint8_t)atoi(argv[1]);
-    uint32_t io_cap = (uint8_t)atoi(argv[2]);
+    at_push_runnable(stack_restore_config, NULL, 0);
+}
 
-    uintptr_t v = (io_cap << 8) | enable;
+extern void config_wakeup_and_shutdown(void);
 
-    btstack_push_user_runnable(stack_set_sec_param, (void *)v, 0);
+// OTA over UART
+//
+// After AT+OTA, UART is in binary mode. Each frame from host is:
+//     type (8bit), length (16bit), payload, crc (16bit, of type, length and payload)
+// and is acknowledged by an `ota_uart_ack_t`. Host sends next frame after the ack.
+#define OTA_UART_CTRL               0x01    // payload: same as FOTA_CONTROL
+#define OTA_UART_DATA               0x02    // payload: same as FOTA_DATA
+#define OTA_UART_STATUS             0x03    // payload: no
+#define OTA_UART_EXIT               0x04    // payload: no. Back to AT mode.
 
-    at_tx_ok();
-    return;
+#define OTA_UART_FRAME_ERROR        0xFF    // status of a corrupted frame
 
-error:
-    at_tx_error();
-    return;
-}
+#define OTA_UART_FRAME_OVERHEAD     5
 
-static void reset_all(void)
-{
-    kv_remove_all();
-    kv_commit(1);
-    platform_reset();
-}
+// a partial frame is dropped after UART is idle for this long
+#define OTA_UART_IDLE_US            20000
 
-static void set_power_saving(int argc, const char *argv[])
+#pragma pack (push, 1)
+typedef struct
 {
-    if (argc < 1) goto error;
+    uint8_t  type;
+    uint8_t  status;        // OTA_STATUS_xxx or OTA_UART_FRAME_ERROR
+    uint32_t page_addr;     // current page
+    uint16_t page_offset;   // bytes received of current page, to resume from
+} ota_uart_ack_t;
+#pragma pack (pop)
 
-    platform_config(PLATFORM_CFG_POWER_SAVING, (uint8_t)atoi(argv[0]));
+static volatile uint8_t ota_uart_mode = 0;
+static uint64_t ota_uart_last_rx = 0;
 
+static void get_ota(void)
+{
     at_tx_ok();
-    return;
-
-error:
-    at_tx_error();
-    return;
+    ota_uart_mode = 1;
 }
 
-extern void config_wakeup_and_shutdown(void);
-
 const static cmd_t cmds[] =
 {
     {
@@ -1165,12 +4434,36 @@ const static cmd_t cmds[] =
     {
         // AT+POWERSAVING=<enable>
         .cmd = "+POWERSAVING",
+        .get = get_power_saving,
         .set = set_power_saving,
     },
+    {
+        // AT+OTA
+        .cmd = "+OTA",
+        .get = get_ota,
+    },
+    {
+        // AT+SAVE, AT+SAVE=0
+        .cmd = "+SAVE",
+        .get = get_save,
+        .set = set_save,
+    },
+    {
+        // AT+RESTORE
+        .cmd = "+RESTORE",
+        .get = get_restore,
+    },
     {
         // AT+UART=<baud>
         .cmd = "+UART",
         .set = set_uart,
+        .get = get_uart,
+    },
+    {
+        // AT+UARTFC=<enable>
+        .cmd = "+UARTFC",
+        .set = set_uart_fc,
+        .get = get_uart_fc,
     },
     {
         // AT+BLEINIT?
@@ -1212,17 +4505,71 @@ const static cmd_t cmds[] =
         .cmd = "+BLEADVSTOP",
         .get = get_ble_adv_stop,
     },
+    {
+        // AT+BLEADVSETPARAM=<set>,<adv_int_min>,<adv_int_max>,<adv_type>,...
+        .cmd = "+BLEADVSETPARAM",
+        .get = get_ble_adv_set_param,
+        .set = set_ble_adv_set_param,
+    },
+    {
+        // AT+BLEADVSETDATA=<set>,<type>,<hex_data>[,<append>]
+        .cmd = "+BLEADVSETDATA",
+        .set = set_ble_adv_set_data,
+    },
+    {
+        // AT+BLEADVSETSTART=<set>[,<duration>,<max_events>]
+        .cmd = "+BLEADVSETSTART",
+        .set = set_ble_adv_set_start,
+    },
+    {
+        // AT+BLEADVSETSTOP=<set>
+        .cmd = "+BLEADVSETSTOP",
+        .set = set_ble_adv_set_stop,
+    },
+    {
+        // AT+BLEPERADVPARAM=<set>,<interval_min>,<interval_max>[,<properties>]
+        .cmd = "+BLEPERADVPARAM",
+        .get = get_ble_per_adv_param,
+        .set = set_ble_per_adv_param,
+    },
+    {
+        // AT+BLEPERADVDATA=<set>,<hex_data>[,<append>]
+        .cmd = "+BLEPERADVDATA",
+        .set = set_ble_per_adv_data,
+    },
+    {
+        // AT+BLEPERADVSTART=<set>
+        .cmd = "+BLEPERADVSTART",
+        .set = set_ble_per_adv_start,
+    },
+    {
+        // AT+BLEPERADVSTOP=<set>
+        .cmd = "+BLEPERADVSTOP",
+        .set = set_ble_per_adv_stop,
+    },
     {
         // +BLESCANPARAM:<scan_type>,<own_addr_type>,<filter_policy>,<scan_interval>,<scan_window>
         .cmd = "+BLESCANPARAM",
         .get = get_ble_scan_param,
         .set = set_ble_scan_param,
     },
+    {
+        // AT+BLESCANPHY=<phys>[,<interval_1m>,<window_1m>[,<interval_coded>,<window_coded>]]
+        .cmd = "+BLESCANPHY",
+        .get = get_ble_scan_phy,
+        .set = set_ble_scan_phy,
+    },
     {
         // AT+BLESCAN=<enable>[[,<interval>],<filter_type>,<filter_param>]
         .cmd = "+BLESCAN",
         .set = set_ble_scan,
     },
+    {
+        // AT+BLESCANLIST[=<since_ms>]
+        .cmd = "+BLESCANLIST",
+        .get = get_ble_scan_list,
+        .set = set_ble_scan_list,
+    },
     {
         // AT+BLECONN=<conn_index>,<remote_address>,<addr_type>[,<timeout>]
         .cmd = "+BLECONN",
@@ -1235,6 +4582,28 @@ const static cmd_t cmds[] =
         .get = get_ble_conn_param,
         .set = set_ble_conn_param,
     },
+    {
+        // AT+BLEPERSYNC=<addr>,<addr_type>,<sid>[,<timeout>[,<dedup>]]
+        .cmd = "+BLEPERSYNC",
+        .get = get_ble_per_sync,
+        .set = set_ble_per_sync,
+    },
+    {
+        // AT+BLEPERSYNCSTOP=<sync_index>
+        .cmd = "+BLEPERSYNCSTOP",
+        .set = set_ble_per_sync_stop,
+    },
+    {
+        // AT+BLECONNPHY=<conn_index>,<tx_phys>,<rx_phys>[,<phy_opt>]
+        .cmd = "+BLECONNPHY",
+        .get = get_ble_conn_phy,
+        .set = set_ble_conn_phy,
+    },
+    {
+        // AT+BLELQ=<period_ms>
+        .cmd = "+BLELQ",
+        .set = set_ble_lq,
+    },
     {
         // AT+BLEDISCONN=<conn_index>
         .cmd = "+BLEDISCONN",
@@ -1245,21 +4614,62 @@ const static cmd_t cmds[] =
         .cmd = "+BLEGATTC",
         .set = set_ble_gattc,
     },
+    {
+        // AT+BLEGATTCQ=<depth>
+        .cmd = "+BLEGATTCQ",
+        .set = set_ble_gattc_queue,
+        .get = get_ble_gattc_queue,
+    },
     {
         // AT+BLEGATTCRD=<conn_index>,<handle>
         .cmd = "+BLEGATTCRD",
         .set = set_ble_gattc_read,
     },
+    {
+        // AT+BLEGATTCRDM=<conn_index>,<handle1>,<handle2>[,...]
+        .cmd = "+BLEGATTCRDM",
+        .set = set_ble_gattc_read_multi,
+    },
+    {
+        // AT+BLEGATTCRDL=<conn_index>,<handle>
+        .cmd = "+BLEGATTCRDL",
+        .set = set_ble_gattc_read_long,
+    },
     {
         // AT+BLEGATTCWR=<conn_index>,<handle>,<value>
         .cmd = "+BLEGATTCWR",
         .set = set_ble_gattc_write,
     },
+    {
+        // AT+BLEGATTCWRL=<conn_index>,<handle>,<value>
+        .cmd = "+BLEGATTCWRL",
+        .set = set_ble_gattc_write_long,
+    },
+    {
+        // AT+BLEGATTCWRNR=<conn_index>,<handle>,<value>
+        .cmd = "+BLEGATTCWRNR",
+        .set = set_ble_gattc_write_nr,
+    },
     {
         // AT+BLEGATTCSUB=<conn_index>,<handle>,<config>[,<desc_handle>]
         .cmd = "+BLEGATTCSUB",
         .set = set_ble_gattc_sub,
     },
+    {
+        // AT+BLETPUT=<conn_index>,<handle>,<bytes>,<size>[,<mode>]
+        .cmd = "+BLETPUT",
+        .set = set_ble_tput,
+    },
+    {
+        // AT+BLETPUTRX=<conn_index>,<handle>[,<bytes>]
+        .cmd = "+BLETPUTRX",
+        .set = set_ble_tput_rx,
+    },
+    {
+        // AT+BLEPING=<conn_index>[,<count>[,<handle>]]
+        .cmd = "+BLEPING",
+        .set = set_ble_ping,
+    },
     {
         // +BLEGATTSRD=<conn_index>,<att_handle>,<hex_data>
         .cmd = "+BLEGATTSRD",
@@ -1270,6 +4680,27 @@ const static cmd_t cmds[] =
         .cmd = "+BLEGATTSWR",
         .set = set_ble_gatts_write,
     },
+    {
+        // AT+BLEGATTSSRV=<uuid>
+        .cmd = "+BLEGATTSSRV",
+        .set = set_ble_gatts_srv,
+    },
+    {
+        // AT+BLEGATTSCHAR=<uuid>,<properties>
+        .cmd = "+BLEGATTSCHAR",
+        .set = set_ble_gatts_char,
+    },
+    {
+        // AT+BLEGATTSDB=<op>
+        .cmd = "+BLEGATTSDB",
+        .get = get_ble_gatts_db,
+        .set = set_ble_gatts_db,
+    },
+    {
+        // AT+BLEGATTSSET=<att_handle>[,<hex_data>]
+        .cmd = "+BLEGATTSSET",
+        .set = set_ble_gatts_set,
+    },
     {
         // +BLESECPARAM:<enable>,<auth_req>,<io_cap>
         .cmd = "+BLESECPARAM",
@@ -1288,6 +4719,24 @@ static void handle_command(char *cmd_line)
         goto show_help;
 
     param += 2;
+
+    // the host talks to us at the new rate
+    if (uart_old_baud)
+        btstack_push_user_runnable(stack_confirm_baud, NULL, 0);
+
+    if (param[0] == '#')
+    {
+        int tag = 0;
+        param++;
+        if ((*param < '0') || (*param > '9')) goto show_help;
+        while ((*param >= '0') && (*param <= '9'))
+        {
+            tag = tag * 10 + *param++ - '0';
+            if (tag > MAX_TAG) goto show_help;
+        }
+        cmd_tag = (int16_t)tag;
+    }
+
     cmd_params.cmd = param;
     cmd_params.argc = 0;
 
@@ -1318,6 +4767,8 @@ static void handle_command(char *cmd_line)
         {
             uint8_t is_quote = param[0] == '"';
             if (is_quote) param++;
+            if (cmd_params.argc >= MAX_ARG_C)
+                goto show_help;
             cmd_params.argv[cmd_params.argc++] = param;
 
             if (is_quote)
@@ -1360,22 +4811,30 @@ show_help:
     tx_data(unknow_cmd, strlen(unknow_cmd) + 1);
 }
 
+// long enough for a command carrying a value of MAX_LONG_VALUE_SIZE bytes
+#define INPUT_BUF_SIZE      (MAX_LONG_VALUE_SIZE * 2 + 64)
+#define OUTPUT_BUF_SIZE     256
+
 typedef struct
 {
     uint8_t busy;
     uint16_t size;
-    char buf[256];
+    uint16_t cap;
+    char *buf;
 } str_buf_t;
 
-str_buf_t input = {0};
-str_buf_t output = {0};
+static char input_buf[INPUT_BUF_SIZE];
+static char output_buf[OUTPUT_BUF_SIZE];
+
+str_buf_t input = {.cap = sizeof(input_buf), .buf = input_buf};
+str_buf_t output = {.cap = sizeof(output_buf), .buf = output_buf};
 
 static void append_data(str_buf_t *buf, const char *d, const uint16_t len)
 {
-    if (buf->size + len > sizeof(buf->buf))
+    if (buf->size + len > buf->cap)
         buf->size = 0;
 
-    if (buf->size + len <= sizeof(buf->buf))
+    if (buf->size + len <= buf->cap)
     {
         memcpy(buf->buf + buf->size, d, len);
         buf->size += len;
@@ -1384,13 +4843,114 @@ static void append_data(str_buf_t *buf, const char *d, const uint16_t len)
 
 static gen_handle_t cmd_event = NULL;
 
+static void tx_raw(const uint8_t *d, int len)
+{
+    extern uint32_t cb_putc(char *c, void *dummy);
+    int i;
+    uart_wake_tx_begin();
+    GEN_OS->enter_critical();
+    for (i = 0; i < len; i++)
+        cb_putc((char *)d + i, NULL);
+    GEN_OS->leave_critical();
+}
+
+// `frame` is a copy owned by this runnable: type, length and payload.
+// OTA service runs in stack context, same as over BLE.
+static void stack_ota_uart_frame(void *frame, uint16_t len)
+{
+    const uint8_t *f = (const uint8_t *)frame;
+    ota_uart_ack_t ack;
+    uint32_t page_offset;
+
+    ack.type = f[0];
+    switch (f[0])
+    {
+    case OTA_UART_CTRL:
+        ota_write_ctrl(f + 3, len);
+        break;
+    case OTA_UART_DATA:
+        ota_write_data(f + 3, len);
+        break;
+    case OTA_UART_EXIT:
+        ota_uart_mode = 0;
+        break;
+    default:
+        break;
+    }
+    free(frame);
+
+    ota_get_progress(&ack.status, &ack.page_addr, &page_offset);
+    ack.page_offset = (uint16_t)page_offset;
+    tx_raw((const uint8_t *)&ack, sizeof(ack));
+}
+
+static void ota_uart_handle_frame(void)
+{
+    const uint8_t *f = (const uint8_t *)input.buf;
+    uint16_t len = f[1] | (f[2] << 8);
+    ota_uart_ack_t ack;
+    uint32_t page_offset;
+    uint8_t *copy;
+
+    if (   (input.size < len + OTA_UART_FRAME_OVERHEAD)
+        || (crc((uint8_t *)f, len + 3) != (f[len + 3] | (f[len + 4] << 8)))
+        || (f[0] < OTA_UART_CTRL) || (f[0] > OTA_UART_EXIT)
+        || ((OTA_UART_CTRL == f[0]) && (len < 1)))
+    {
+        ota_get_progress(&ack.status, &ack.page_addr, &page_offset);
+        ack.type = f[0];
+        ack.status = OTA_UART_FRAME_ERROR;
+        ack.page_offset = (uint16_t)page_offset;
+        tx_raw((const uint8_t *)&ack, sizeof(ack));
+        return;
+    }
+
+    // acknowledged by the runnable; host sends nothing before that
+    copy = (uint8_t *)at_alloc(len + 3);
+    memcpy(copy, f, len + 3);
+    btstack_push_user_runnable(stack_ota_uart_frame, copy, len);
+}
+
+static void ota_uart_rx_data(const char *d, uint8_t len)
+{
+    uint64_t now = platform_get_us_time();
+
+    if (input.busy)
+        return;
+
+    if ((input.size > 0) && (now - ota_uart_last_rx > OTA_UART_IDLE_US))
+        input.size = 0;
+    ota_uart_last_rx = now;
+
+    while (len--)
+    {
+        input.buf[input.size++] = *d++;
+        if (input.size >= 3)
+        {
+            uint32_t total = ((uint8_t)input.buf[1] | ((uint8_t)input.buf[2] << 8)) + OTA_UART_FRAME_OVERHEAD;
+            // an oversized frame is completed here, and rejected as corrupted
+            if ((input.size >= total) || (input.size >= input.cap))
+            {
+                input.busy = 1;
+                GEN_OS->event_set(cmd_event);
+                return;
+            }
+        }
+    }
+}
+
 static void at_task_entry(void *_)
 {
+    at_task = xTaskGetCurrentTaskHandle();
     while (1)
     {
         GEN_OS->event_wait(cmd_event);
 
-        handle_command(input.buf);
+        if (ota_uart_mode)
+            ota_uart_handle_frame();
+        else
+            handle_command(input.buf);
+        cmd_tag = NO_TAG;
         input.size = 0;
         input.busy = 0;
     }
@@ -1399,6 +4959,8 @@ static void at_task_entry(void *_)
 void uart_at_start(void)
 {
     extern void update_baud(uint32_t baud);
+    extern void uart_set_flow_control(uint8_t enable);
+    extern int uart_baud_supported(uint32_t baud);
 
     cmd_event = GEN_OS->event_create();
     GEN_OS->task_create("AT",
@@ -1408,6 +4970,7 @@ void uart_at_start(void)
         GEN_TASK_PRIORITY_LOW);
 
     ll_set_max_conn_number(TOTAL_CONN_NUM);
+    memset(scan_buckets, SCAN_NIL, sizeof(scan_buckets));
 
     int i;
     for (i = 0; i < TOTAL_CONN_NUM; i++)
@@ -1418,22 +4981,49 @@ void uart_at_start(void)
         p->min_interval = 350;
         p->max_interval = 350;
         p->timeout = 800;
+        p->tx_phys = PHY_2M_BIT;
+        p->rx_phys = PHY_2M_BIT;
+        p->phy_opt = HOST_PREFER_S2_CODING;
+        p->lq.rssi = LQ_RSSI_UNKNOWN;
     }
 
-    const struct uart_settings *p_uart = (const struct uart_settings *)kv_get(KV_KEY_UART, NULL);
-    if (p_uart == NULL)
+    int16_t size = 0;
+    const struct uart_settings *p_uart = (const struct uart_settings *)kv_get(KV_KEY_UART, &size);
+    if ((p_uart == NULL) || (size < (int16_t)sizeof(def_uart_settings)))
+    {
+        // settings saved by older versions are shorter
+        struct uart_settings settings = def_uart_settings;
+        if (p_uart) memcpy(&settings, p_uart, size);
+        kv_put(KV_KEY_UART, (const uint8_t *)&settings, sizeof(settings));
+        p_uart = (const struct uart_settings *)kv_get(KV_KEY_UART, NULL);
+    }
+
+    // saved by a build with a faster UART clock
+    if (!uart_baud_supported(p_uart->baud))
     {
-        kv_put(KV_KEY_UART, (const uint8_t *)&def_uart_settings, sizeof(def_uart_settings));
+        struct uart_settings settings = *p_uart;
+        settings.baud = def_uart_settings.baud;
+        kv_put(KV_KEY_UART, (const uint8_t *)&settings, sizeof(settings));
         p_uart = (const struct uart_settings *)kv_get(KV_KEY_UART, NULL);
     }
 
     update_baud(p_uart->baud);
+    uart_set_flow_control(p_uart->flow_control);
+
+    load_gatt_db();
+    load_config();
 
     at_tx_ok();
 }
 
 void at_rx_data(const char *d, uint8_t len)
 {
+    if (ota_uart_mode)
+    {
+        ota_uart_rx_data(d, len);
+        return;
+    }
+
     if (input.busy)
     {
         return;
@@ -1464,16 +5054,50 @@ void at_rx_data(const char *d, uint8_t len)
 
 extern void stack_notify_tx_data(void);
 
+int at_rx_pending(void)
+{
+    return input.size || input.busy;
+}
+
 static void tx_data(const char *d, const uint16_t len)
 {
+    // keep the binary stream of OTA clean
+    if (ota_uart_mode)
+        return;
+
+    uart_wake_tx_begin();
+
     GEN_OS->enter_critical();
 
+    // the prefix goes out directly, so a tagged line still takes the fast
+    // path below, which has no length limit
+    if (output.size == 0)
+    {
+        int16_t tag = current_tag();
+        if (tag != NO_TAG)
+            printf("#%d", tag);
+    }
+
     if ((output.size == 0) && (d[len - 1] == '\0'))
     {
         puts(d);
         goto exit;
     }
 
+    if (output.size + len > output.cap)
+    {
+        // too long to be buffered (e.g. a long value following a partial
+        // line): stream out the pending part and then this one, instead of
+        // dropping them
+        printf("%.*s", output.size, output.buf);
+        output.size = 0;
+        if (d[len - 1] == '\0')
+            puts(d);
+        else
+            printf("%.*s", len, d);
+        goto exit;
+    }
+
     append_data(&output, d, len);
 
     if ((output.size > 0) && (output.buf[output.size - 1] == '\0'))
@@ -1493,20 +5117,95 @@ uint8_t *at_clear_tx_data(uint16_t *len)
     return (uint8_t *)output.buf;
 }
 
+static void report_gatts_write(hci_con_handle_t connection_handle, uint16_t att_handle,
+                               const uint8_t *value, uint16_t len)
+{
+    sprintf(buffer, "+BLEGATTSWR:%d,%d,\"", get_id_of_handle(connection_handle), att_handle);
+    tx_hex_value(buffer, value, len, "\"\n");
+}
+
+// queued writes are collected and reported as a whole when executed.
+static int prepared_write(conn_info_t *p, uint16_t att_handle, uint16_t transaction_mode,
+                          uint16_t offset, const uint8_t *att_buffer, uint16_t buffer_size)
+{
+    struct long_value *v = &p->prepared_write;
+
+    switch (transaction_mode)
+    {
+    case ATT_TRANSACTION_MODE_ACTIVE:
+        if (NULL == v->data)
+        {
+            v->data = (uint8_t *)at_alloc(MAX_LONG_VALUE_SIZE);
+            v->value_handle = att_handle;
+            v->len = 0;
+        }
+        else if (v->value_handle != att_handle)
+            return ATT_ERROR_PREPARE_QUEUE_FULL;
+
+        if (offset > v->len)
+            return ATT_ERROR_INVALID_OFFSET;
+        if (offset + buffer_size > MAX_LONG_VALUE_SIZE)
+            return ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+
+        memcpy(v->data + offset, att_buffer, buffer_size);
+        if (offset + buffer_size > v->len)
+            v->len = offset + buffer_size;
+        break;
+    case ATT_TRANSACTION_MODE_EXECUTE:
+        if (v->data)
+        {
+            gatts_cache_update(v->value_handle, v->data, v->len);
+            report_gatts_write(p->handle, v->value_handle, v->data, v->len);
+        }
+        free_long_value(v);
+        break;
+    default:
+        free_long_value(v);
+        break;
+    }
+    return 0;
+}
+
 int at_att_write_callback(hci_con_handle_t connection_handle, uint16_t att_handle, uint16_t transaction_mode,
                               uint16_t offset, const uint8_t *att_buffer, uint16_t buffer_size)
 {
-    char *s = buffer + sprintf(buffer, "+BLEGATTSWR:%d,%d,\"", get_id_of_handle(connection_handle), att_handle);
-    s = append_hex_str(s, att_buffer, buffer_size);
-    s = s + sprintf(s, "\"\n");
-    tx_data(buffer, s - buffer + 1);
+    if (transaction_mode != ATT_TRANSACTION_MODE_NONE)
+        return prepared_write(conn_infos + get_id_of_handle(connection_handle), att_handle,
+                              transaction_mode, offset, att_buffer, buffer_size);
+
+    if (tput_rx_data(conn_infos + get_id_of_handle(connection_handle), att_handle, att_buffer, buffer_size))
+        return 0;
+
+    gatts_cache_update(att_handle, att_buffer, buffer_size);
+    report_gatts_write(connection_handle, att_handle, att_buffer, buffer_size);
     return 0;
 }
 
 uint16_t at_att_read_callback(hci_con_handle_t connection_handle, uint16_t att_handle, uint16_t offset,
                                   uint8_t * att_buffer, uint16_t buffer_size)
 {
-    sprintf(buffer, "+BLEGATTSRD:%d,%d\n", get_id_of_handle(connection_handle), att_handle);
+    conn_info_t *p = conn_infos + get_id_of_handle(connection_handle);
+    struct long_value *v = gatts_cache_find(att_handle);
+
+    // Read Blob of a value previously given by the host
+    if ((NULL == v) && (offset > 0) && p->read_response.data
+        && (p->read_response.value_handle == att_handle))
+        v = &p->read_response;
+
+    if (v)
+    {
+        if (NULL == att_buffer)
+            return v->len;
+        if (offset >= v->len)
+            return 0;
+        if (buffer_size > v->len - offset)
+            buffer_size = v->len - offset;
+        memcpy(att_buffer, v->data + offset, buffer_size);
+        return buffer_size;
+    }
+
+    int len = sprintf(buffer, "+BLEGATTSRD:%d,%d\n", get_id_of_handle(connection_handle), att_handle);
+    tx_data(buffer, len + 1);
     return ATT_DEFERRED_READ;
 }
 
@@ -1582,6 +5281,10 @@ void at_on_connection_complete(const le_meta_event_enh_create_conn_complete_t *c
         p->cur_interval = complete->interval;
         p->latency = complete->latency;
         p->timeout = complete->sup_timeout;
+        // the initiating PHY is not reported, so read the actual one
+        p->tx_phy = p->rx_phy = PHY_1M;
+        gap_read_phy(complete->handle);
+        stack_set_phy(NULL, p - conn_infos);
 
         report_connected(get_id_of_handle(complete->handle));
     }
@@ -1603,6 +5306,21 @@ void at_on_disconnect(const event_disconn_complete_t *complete)
         free(first);
         first = p->first_handler;
     }
+
+    wrnr_free(p);
+    gattc_free(p);
+    if (p->tput_tx.mode != TPUT_NONE) tput_report(p, complete->reason);
+    if (p->tput_rx.mode != TPUT_NONE) tput_rx_report(p);
+    if (p->lq.waiting)
+    {
+        p->lq.waiting = 0;
+        if (--lq_pending == 0) lq_report();
+    }
+    memset(&p->lq, 0, sizeof(p->lq));
+    p->lq.rssi = LQ_RSSI_UNKNOWN;
+    free_long_value(&p->client_long);
+    free_long_value(&p->prepared_write);
+    free_long_value(&p->read_response);
 }
 
 void at_on_sm_state_changed(uint8_t reason)
@@ -6,4 +6,12 @@ void at_rx_data(const char *d, const uint8_t len);
 uint8_t *at_clear_tx_data(uint16_t *len);
 void uart_at_start(void);
 void at_tx_ok(void);
+// non-zero if a command is being received or handled
+int at_rx_pending(void);
+
+// UART wake protocol (main.c)
+// called before sending anything to host; output is held back while host
+// wakes up
+void uart_wake_tx_begin(void);
+void uart_wake_get_latency(uint32_t *last, uint32_t *max);
 #endif
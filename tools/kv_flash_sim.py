@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+"""Host simulation of the kv storage flash log (see db_write_to_flash in main.c).
+
+The database is kept as an append-only log in two flash sectors: a commit only
+appends the bytes that changed, and when the active sector is full the whole
+database is compacted into the other one. This script replays random commits
+against a simulated flash using the same layout and rules:
+
+    sector: magic (u32), seq (u32), followed by records
+    record: offset (u16), len (u16), check (u16), reserved (u16),
+            then `len` bytes of data padded to 4 bytes
+
+The records of a commit are followed by a commit record (offset 0xfffe, no
+data), and only complete commits are replayed.
+
+It compares commit latency and write amplification with the old scheme, which
+erases a sector and rewrites the whole database on every commit. Simulated
+reboots replay the log and check that the database is restored exactly.
+Simulated power losses cut a commit at a random word write or erase, and
+check that the database restored afterwards is the one before or after that
+commit, never a mix of both.
+
+Flash timing defaults are rough figures; pass the ones of your chip.
+"""
+
+import argparse
+import copy
+import random
+import struct
+import sys
+
+MAGIC = 0x474c564b
+SECTOR_HEADER = 8
+RECORD_HEADER = 8
+RECORD_END = 0xffff
+RECORD_COMMIT = 0xfffe
+MERGE_GAP = RECORD_HEADER
+
+
+def align4(n):
+    return (n + 3) & ~3
+
+
+def crc16(data):
+    c = 0xffff
+    for b in data:
+        c ^= b
+        for _ in range(8):
+            c = (c >> 1) ^ 0xa001 if c & 1 else c >> 1
+    return c
+
+
+def record_check(offset, data):
+    return crc16(data) ^ offset ^ len(data)
+
+
+class PowerLoss(Exception):
+    pass
+
+
+class Flash:
+    def __init__(self, sector_size, rnd):
+        self.sector_size = sector_size
+        self.mem = bytearray(b'\xff' * sector_size * 2)
+        self.erases = 0
+        self.programmed = 0
+        self.rnd = rnd
+        self.budget = None          # erases and word writes left before power is cut
+
+    def spend(self):
+        if self.budget is None:
+            return True
+        if self.budget == 0:
+            return False
+        self.budget -= 1
+        return True
+
+    def erase(self, sector):
+        base = sector * self.sector_size
+        if not self.spend():
+            # interrupted erase: only part of the sector is erased
+            n = self.rnd.randrange(self.sector_size)
+            self.mem[base:base + n] = b'\xff' * n
+            raise PowerLoss()
+        self.mem[base:base + self.sector_size] = b'\xff' * self.sector_size
+        self.erases += 1
+
+    def write(self, addr, data):
+        assert addr % 4 == 0 and len(data) % 4 == 0
+        for w in range(0, len(data), 4):
+            if not self.spend():
+                # interrupted program: some bits of the word are programmed
+                for i in range(4):
+                    self.mem[addr + w + i] &= data[w + i] | self.rnd.randrange(256)
+                raise PowerLoss()
+            for i in range(4):
+                self.mem[addr + w + i] &= data[w + i]
+        self.programmed += len(data)
+
+
+class LogDb:
+    def __init__(self, flash):
+        self.flash = flash
+        self.sector = 0
+        self.seq = 0
+        self.log_end = 0
+        self.shadow = None
+        self.need_compact = True
+
+    def sector_end(self):
+        return (self.sector + 1) * self.flash.sector_size
+
+    def append(self, offset, data):
+        padded = align4(len(data))
+        # room is always kept for the commit record
+        end = self.sector_end() - (0 if offset == RECORD_COMMIT else RECORD_HEADER)
+        if self.log_end + RECORD_HEADER + padded > end:
+            return False
+        self.flash.write(self.log_end + RECORD_HEADER,
+                         bytes(data) + b'\xff' * (padded - len(data)))
+        self.flash.write(self.log_end, struct.pack('<HHHH', offset, len(data),
+                                                   record_check(offset, data), 0xffff))
+        self.log_end += RECORD_HEADER + padded
+        return True
+
+    def compact(self, db):
+        old = (self.sector, self.log_end)
+        self.sector ^= 1
+        self.flash.erase(self.sector)
+        self.log_end = self.sector * self.flash.sector_size + SECTOR_HEADER
+        if not self.append(0, db) or not self.append(RECORD_COMMIT, b''):
+            self.sector, self.log_end = old
+            self.need_compact = True
+            return False
+        self.seq += 1
+        self.flash.write(self.sector * self.flash.sector_size, struct.pack('<II', MAGIC, self.seq))
+        self.need_compact = False
+        return True
+
+    def commit(self, db):
+        if not self.need_compact:
+            log_start = self.log_end
+            i = 0
+            while i < len(db):
+                if db[i] == self.shadow[i]:
+                    i += 1
+                    continue
+                start = last = i
+                j = i + 1
+                while j < len(db) and j - last <= MERGE_GAP:
+                    if db[j] != self.shadow[j]:
+                        last = j
+                    j += 1
+                if not self.append(start, db[start:last + 1]):
+                    break
+                i = last + 1
+            else:
+                if self.log_end != log_start:
+                    self.append(RECORD_COMMIT, b'')
+                self.shadow = bytearray(db)
+                return True
+        if not self.compact(db):
+            return False
+        self.shadow = bytearray(db)
+        return True
+
+    def load(self, size):
+        mem = self.flash.mem
+        headers = [struct.unpack_from('<II', mem, s * self.flash.sector_size) for s in range(2)]
+        valid = [s for s in range(2) if headers[s][0] == MAGIC]
+        db = bytearray(b'\xff' * size)
+        self.need_compact = False
+        if not valid:
+            self.sector, self.seq, self.need_compact = 0, 0, True
+            self.shadow = bytearray(db)
+            return db
+        if len(valid) == 2:
+            diff = (headers[1][1] - headers[0][1]) & 0xffffffff
+            self.sector = 1 if 0 < diff < 0x80000000 else 0
+        else:
+            self.sector = valid[0]
+        self.seq = headers[self.sector][1]
+        addr = self.sector * self.flash.sector_size + SECTOR_HEADER
+        end = self.sector_end()
+        self.log_end = addr
+        records = []
+        committed = []
+        while addr + RECORD_HEADER <= end:
+            offset, length, check, _ = struct.unpack_from('<HHHH', mem, addr)
+            if offset == RECORD_END:
+                break
+            data = mem[addr + RECORD_HEADER:addr + RECORD_HEADER + length]
+            if (offset != RECORD_COMMIT and offset + length > size) \
+                    or addr + RECORD_HEADER + align4(length) > end \
+                    or check != record_check(offset, data):
+                break
+            addr += RECORD_HEADER + align4(length)
+            if offset == RECORD_COMMIT:
+                committed += records
+                records = []
+                self.log_end = addr
+            else:
+                records.append((offset, data))
+        # records after the last commit record belong to an interrupted commit
+        for offset, data in committed:
+            db[offset:offset + len(data)] = data
+        if any(b != 0xff for b in mem[self.log_end:end]):
+            self.need_compact = True
+        self.shadow = bytearray(db)
+        return db
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--sector-size', type=int, default=4096, help='EFLASH_ERASABLE_SIZE')
+    parser.add_argument('--db-size', type=int, default=600, help='size of the kv database')
+    parser.add_argument('--commits', type=int, default=5000)
+    parser.add_argument('--max-changes', type=int, default=3,
+                        help='values updated per commit, 1 .. N')
+    parser.add_argument('--max-value', type=int, default=8, help='bytes changed per value, 1 .. N')
+    parser.add_argument('--reboot-every', type=int, default=50,
+                        help='average commits between simulated reboots')
+    parser.add_argument('--power-loss-every', type=int, default=20,
+                        help='average commits between simulated power losses, 0 for none')
+    parser.add_argument('--erase-ms', type=float, default=20.0, help='sector erase time')
+    parser.add_argument('--word-us', type=float, default=8.0, help='program time per 32-bit word')
+    parser.add_argument('--seed', type=int, default=3)
+    args = parser.parse_args()
+
+    rnd = random.Random(args.seed)
+    flash = Flash(args.sector_size, rnd)
+    log = LogDb(flash)
+    db = log.load(args.db_size)
+
+    def cost_ms(erases, programmed):
+        return erases * args.erase_ms + programmed / 4 * args.word_us / 1000
+
+    changed = 0
+    latencies = []
+    losses = 0
+    for n in range(args.commits):
+        for _ in range(rnd.randint(1, args.max_changes)):
+            offset = rnd.randrange(args.db_size)
+            length = min(rnd.randint(1, args.max_value), args.db_size - offset)
+            for k in range(length):
+                db[offset + k] = rnd.randrange(256)
+            changed += length
+
+        if args.power_loss_every and rnd.randrange(args.power_loss_every) == 0:
+            # count the flash operations of this commit on a copy, then cut
+            # power at a random one of them
+            dry = copy.deepcopy(log)
+            dry.flash.budget = 1 << 30
+            dry.commit(db)
+            ops = (1 << 30) - dry.flash.budget
+            if ops:
+                flash.budget = rnd.randrange(ops)
+                before = bytes(log.shadow)
+                try:
+                    log.commit(db)
+                except PowerLoss:
+                    pass
+                flash.budget = None
+                losses += 1
+                log = LogDb(flash)
+                db = log.load(args.db_size)
+                if db != before and db != dry.shadow:
+                    print('mismatch after power loss at commit %d' % n)
+                    return 1
+                continue
+
+        erases, programmed = flash.erases, flash.programmed
+        if not log.commit(db):
+            print('commit %d failed: database does not fit in a sector' % n)
+            return 1
+        latencies.append(cost_ms(flash.erases - erases, flash.programmed - programmed))
+
+        if rnd.randrange(args.reboot_every) == 0:
+            restored = LogDb(flash).load(args.db_size)
+            if restored != db:
+                print('mismatch after reboot at commit %d' % n)
+                return 1
+            log = LogDb(flash)
+            db = log.load(args.db_size)
+
+    full_programmed = align4(args.db_size) * args.commits
+    full_ms = cost_ms(1, align4(args.db_size))
+    latencies.sort()
+    print('commits:             %d, %d bytes changed, %d power losses'
+          % (args.commits, changed, losses))
+    print('log:                 %d bytes programmed, %d erases, amplification %.2f'
+          % (flash.programmed, flash.erases, flash.programmed / changed))
+    print('full rewrite:        %d bytes programmed, %d erases, amplification %.2f'
+          % (full_programmed, args.commits, full_programmed / changed))
+    print('log latency (ms):    avg %.3f, median %.3f, max %.3f'
+          % (sum(latencies) / len(latencies), latencies[len(latencies) // 2], latencies[-1]))
+    print('full latency (ms):   %.3f per commit' % full_ms)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Compress a firmware image page by page for OTA_CTRL_PAGE_BEGIN_LZ4.
+
+Each page is compressed independently in LZ4 block format, so that the
+device can decompress it directly into its page buffer.
+
+Output file layout (little endian):
+
+    "OLZ4", page_size (u32), load_address (u32), page_count (u32)
+    then for each page:
+        flags (u8), raw_size (u16), data_size (u16), data
+
+flags bit 0 is set when `data` is LZ4 compressed, otherwise the page is
+stored as is (not compressible) and should be sent with OTA_CTRL_PAGE_BEGIN.
+Page CRC is computed over the raw page, exactly as for uncompressed pages.
+
+Requires: pip install lz4
+"""
+
+import argparse
+import struct
+import sys
+
+import lz4.block
+
+FLAG_LZ4 = 1
+
+
+def compress_pages(image, page_size):
+    for off in range(0, len(image), page_size):
+        raw = image[off:off + page_size]
+        packed = lz4.block.compress(raw, mode='high_compression',
+                                    compression=12, store_size=False)
+        if len(packed) < len(raw):
+            yield raw, FLAG_LZ4, packed
+        else:
+            yield raw, 0, raw
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('input', help='raw binary image')
+    parser.add_argument('output', help='compressed OTA image')
+    parser.add_argument('--address', type=lambda s: int(s, 0), default=0,
+                        help='load address of the image')
+    parser.add_argument('--page-size', type=lambda s: int(s, 0), default=4096,
+                        help='EFLASH_ERASABLE_SIZE of the target (default 4096)')
+    parser.add_argument('--link-kbps', type=float, default=0,
+                        help='measured throughput of FOTA Data writes; '
+                             'when given, estimate the effective OTA throughput')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f:
+        image = f.read()
+
+    raw_total = 0
+    sent_total = 0
+    pages = list(compress_pages(image, args.page_size))
+    with open(args.output, 'wb') as f:
+        f.write(b'OLZ4' + struct.pack('<III', args.page_size, args.address, len(pages)))
+        for raw, flags, data in pages:
+            f.write(struct.pack('<BHH', flags, len(raw), len(data)))
+            f.write(data)
+            raw_total += len(raw)
+            sent_total += len(data)
+
+    if raw_total == 0:
+        print('empty image')
+        return 1
+
+    ratio = sent_total / raw_total
+    print('pages: %d, compressed: %d' % (len(pages), sum(1 for p in pages if p[1] & FLAG_LZ4)))
+    print('raw: %d bytes, sent: %d bytes, ratio: %.1f%%' % (raw_total, sent_total, ratio * 100))
+    if args.link_kbps > 0:
+        print('effective throughput: %.1f kbps (link %.1f kbps)'
+              % (args.link_kbps / ratio, args.link_kbps))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())